@@ -0,0 +1,171 @@
+#include <stdlib.h>
+
+#include "processx.h"
+
+/* A process-wide pool of connection buffers
+ *
+ * With thousands of processes most connections are idle, so instead of
+ * keeping their buffers for their whole lifetime, connections borrow
+ * buffers from this pool when data arrives, and give them back once all
+ * data was read from them, see `processx__connection_drained()`.
+ *
+ * The pool hands out pages of `PROCESSX_BUFFER_INITIAL` bytes. The
+ * pages are allocated in slabs, and each slab has a list of its free
+ * pages. Slabs with free pages are on a doubly linked list. We keep at
+ * most one completely free slab, the others are freed, so the memory
+ * goes back to the system after a burst of output.
+ *
+ * Buffers of other sizes (custom `initial` sizes and long lines) are
+ * allocated with `malloc()`, these are the fallback allocations.
+ *
+ * Only the R thread allocates and frees connection buffers, so there is
+ * no locking here.
+ */
+
+#define PROCESSX__POOL_PAGE PROCESSX_BUFFER_INITIAL
+#define PROCESSX__POOL_SLAB_PAGES 16
+
+typedef struct processx__pool_slab_s {
+  struct processx__pool_slab_s *prev, *next;
+  void *free;			/* free pages, linked through the pages */
+  int nfree;
+} processx__pool_slab_t;
+
+/* Every page has a header, to find its slab */
+
+typedef union processx__pool_header_u {
+  processx__pool_slab_t *slab;
+  double align_double;
+  long long align_ll;
+} processx__pool_header_t;
+
+#define PROCESSX__POOL_STRIDE \
+  (sizeof(processx__pool_header_t) + PROCESSX__POOL_PAGE)
+
+/* The slab struct comes first, rounded up to keep the pages aligned */
+#define PROCESSX__POOL_SLAB_SIZE					\
+  ((sizeof(processx__pool_slab_t) + sizeof(processx__pool_header_t) - 1) / \
+   sizeof(processx__pool_header_t) * sizeof(processx__pool_header_t))
+
+static processx__pool_slab_t *processx__pool_partial = NULL;
+static size_t processx__pool_slabs = 0;
+static size_t processx__pool_empty = 0;
+static size_t processx__pool_in_use = 0;
+static size_t processx__pool_high_water = 0;
+static double processx__pool_fallback = 0;
+
+static void processx__pool_link(processx__pool_slab_t *slab) {
+  slab->prev = NULL;
+  slab->next = processx__pool_partial;
+  if (processx__pool_partial) processx__pool_partial->prev = slab;
+  processx__pool_partial = slab;
+}
+
+static void processx__pool_unlink(processx__pool_slab_t *slab) {
+  if (slab->prev) slab->prev->next = slab->next;
+  else processx__pool_partial = slab->next;
+  if (slab->next) slab->next->prev = slab->prev;
+  slab->prev = slab->next = NULL;
+}
+
+static processx__pool_slab_t *processx__pool_new_slab(void) {
+  processx__pool_slab_t *slab;
+  char *pages;
+  int i;
+
+  slab = malloc(PROCESSX__POOL_SLAB_SIZE +
+		PROCESSX__POOL_SLAB_PAGES * PROCESSX__POOL_STRIDE);
+  if (!slab) return NULL;
+
+  pages = (char*) slab + PROCESSX__POOL_SLAB_SIZE;
+  slab->free = NULL;
+  for (i = PROCESSX__POOL_SLAB_PAGES - 1; i >= 0; i--) {
+    processx__pool_header_t *hdr =
+      (processx__pool_header_t*) (pages + i * PROCESSX__POOL_STRIDE);
+    void **page = (void**) (hdr + 1);
+    hdr->slab = slab;
+    *page = slab->free;
+    slab->free = page;
+  }
+  slab->nfree = PROCESSX__POOL_SLAB_PAGES;
+  processx__pool_link(slab);
+  processx__pool_slabs++;
+  processx__pool_empty++;
+  return slab;
+}
+
+/* Allocate a buffer of `size` bytes. `*pooled` is set to 1 if the buffer
+   is from the pool. Returns NULL if out of memory. */
+
+void *processx__pool_alloc(size_t size, int *pooled) {
+  processx__pool_slab_t *slab = processx__pool_partial;
+  void **page;
+
+  if (size != PROCESSX__POOL_PAGE) {
+    processx__pool_fallback++;
+    *pooled = 0;
+    return malloc(size);
+  }
+
+  if (!slab) slab = processx__pool_new_slab();
+  if (!slab) {
+    processx__pool_fallback++;
+    *pooled = 0;
+    return malloc(size);
+  }
+
+  if (slab->nfree == PROCESSX__POOL_SLAB_PAGES) processx__pool_empty--;
+  page = slab->free;
+  slab->free = *page;
+  slab->nfree--;
+  if (slab->nfree == 0) processx__pool_unlink(slab);
+
+  processx__pool_in_use++;
+  if (processx__pool_in_use > processx__pool_high_water) {
+    processx__pool_high_water = processx__pool_in_use;
+  }
+
+  *pooled = 1;
+  return page;
+}
+
+void processx__pool_free(void *ptr, int pooled) {
+  processx__pool_header_t *hdr;
+  processx__pool_slab_t *slab;
+  void **page = ptr;
+
+  if (!ptr) return;
+  if (!pooled) {
+    free(ptr);
+    return;
+  }
+
+  hdr = (processx__pool_header_t*) ptr - 1;
+  slab = hdr->slab;
+  *page = slab->free;
+  slab->free = page;
+  slab->nfree++;
+  processx__pool_in_use--;
+  if (slab->nfree == 1) processx__pool_link(slab);
+
+  if (slab->nfree == PROCESSX__POOL_SLAB_PAGES) {
+    if (processx__pool_empty > 0) {
+      processx__pool_unlink(slab);
+      processx__pool_slabs--;
+      free(slab);
+    } else {
+      processx__pool_empty++;
+    }
+  }
+}
+
+SEXP processx_buffer_pool_stats(void) {
+  SEXP result = PROTECT(allocVector(REALSXP, 5));
+  REAL(result)[0] = PROCESSX__POOL_PAGE;
+  REAL(result)[1] = processx__pool_in_use;
+  REAL(result)[2] = processx__pool_high_water;
+  REAL(result)[3] = processx__pool_slabs;
+  REAL(result)[4] = processx__pool_fallback;
+  UNPROTECT(1);
+  return result;
+}
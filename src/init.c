@@ -98,8 +98,10 @@ SEXP is_valgrind_(void)
 
 static const R_CallMethodDef callMethods[]  = {
   CLEANCALL_METHOD_RECORD,
-  { "processx_exec",               (DL_FUNC) &processx_exec,              16 },
+  { "processx_exec",               (DL_FUNC) &processx_exec,              17 },
+  { "processx_exec_many",          (DL_FUNC) &processx_exec_many,          1 },
   { "processx_wait",               (DL_FUNC) &processx_wait,               3 },
+  { "processx_wait_many",          (DL_FUNC) &processx_wait_many,          3 },
   { "processx_is_alive",           (DL_FUNC) &processx_is_alive,           2 },
   { "processx_pty_close",          (DL_FUNC) &processx_pty_close,          2 },
   { "processx_get_exit_status",    (DL_FUNC) &processx_get_exit_status,    2 },
@@ -109,6 +111,24 @@ static const R_CallMethodDef callMethods[]  = {
   { "processx_get_pid",            (DL_FUNC) &processx_get_pid,            1 },
   { "processx_create_time",        (DL_FUNC) &processx_create_time,        1 },
   { "processx_poll",               (DL_FUNC) &processx_poll,               3 },
+  { "processx_poll_sparse",        (DL_FUNC) &processx_poll_sparse,        3 },
+  { "processx_pollset_create",     (DL_FUNC) &processx_pollset_create,     0 },
+  { "processx_pollset_add",        (DL_FUNC) &processx_pollset_add,        3 },
+  { "processx_pollset_remove",     (DL_FUNC) &processx_pollset_remove,     2 },
+  { "processx_pollset_size",       (DL_FUNC) &processx_pollset_size,       1 },
+  { "processx_pollset_wait",       (DL_FUNC) &processx_pollset_wait,       2 },
+  { "processx_run_create",         (DL_FUNC) &processx_run_create,         4 },
+  { "processx_run_collect",        (DL_FUNC) &processx_run_collect,        2 },
+  { "processx_run_input",          (DL_FUNC) &processx_run_input,          3 },
+  { "processx_run_result",         (DL_FUNC) &processx_run_result,         1 },
+  { "processx_pool_create",        (DL_FUNC) &processx_pool_create,        1 },
+  { "processx_pool_submit",        (DL_FUNC) &processx_pool_submit,        4 },
+  { "processx_pool_wait",          (DL_FUNC) &processx_pool_wait,          2 },
+  { "processx_pool_kill",          (DL_FUNC) &processx_pool_kill,          1 },
+  { "processx_pool_stats",         (DL_FUNC) &processx_pool_stats,         1 },
+  { "processx_spawn_server_create", (DL_FUNC) &processx_spawn_server_create, 1 },
+  { "processx_spawn_server_spawn",  (DL_FUNC) &processx_spawn_server_spawn,  8 },
+  { "processx_spawn_server_wait",   (DL_FUNC) &processx_spawn_server_wait,   3 },
   { "processx__process_exists",    (DL_FUNC) &processx__process_exists,    1 },
   { "processx__unload_cleanup",    (DL_FUNC) &processx__unload_cleanup,    0 },
   { "processx_is_named_pipe_open", (DL_FUNC) &processx_is_named_pipe_open, 1 },
@@ -123,7 +143,12 @@ static const R_CallMethodDef callMethods[]  = {
   { "processx_connection_read_chars", (DL_FUNC) &processx_connection_read_chars, 2 },
   { "processx_connection_read_bytes", (DL_FUNC) &processx_connection_read_bytes, 2 },
   { "processx_connection_read_lines", (DL_FUNC) &processx_connection_read_lines, 2 },
+  { "processx_connection_read_all",   (DL_FUNC) &processx_connection_read_all,   2 },
   { "processx_connection_write_bytes",(DL_FUNC) &processx_connection_write_bytes,2 },
+  { "processx_connection_write_queue",(DL_FUNC) &processx_connection_write_queue,2 },
+  { "processx_connection_write_pending",(DL_FUNC) &processx_connection_write_pending,1 },
+  { "processx_connection_relay",      (DL_FUNC) &processx_connection_relay,      3 },
+  { "processx_connection_set_relay",  (DL_FUNC) &processx_connection_set_relay,  2 },
   { "processx_connection_file_name",  (DL_FUNC) &processx_connection_file_name,  1 },
   { "processx_connection_is_eof",     (DL_FUNC) &processx_connection_is_eof,     1 },
   { "processx_connection_close",      (DL_FUNC) &processx_connection_close,      1 },
@@ -151,6 +176,10 @@ static const R_CallMethodDef callMethods[]  = {
   { "processx_connection_set_stdout", (DL_FUNC) &processx_connection_set_stdout,  2 },
   { "processx_connection_set_stderr", (DL_FUNC) &processx_connection_set_stderr,  2 },
   { "processx_connection_get_fileno", (DL_FUNC) &processx_connection_get_fileno,  1 },
+  { "processx_buffer_pool_stats",     (DL_FUNC) &processx_buffer_pool_stats,      0 },
+  { "processx_connection_set_buffer_policy",
+    (DL_FUNC) &processx_connection_set_buffer_policy, 5 },
+  { "processx_connection_background_read", (DL_FUNC) &processx_connection_background_read, 1 },
   { "processx_connection_disable_inheritance",
     (DL_FUNC) &processx_connection_disable_inheritance, 0 },
   { "processx_is_valid_fd",           (DL_FUNC) &processx_is_valid_fd,            1 },
@@ -1,20 +1,34 @@
-
 #include "processx.h"
 
-SEXP processx_poll(SEXP statuses, SEXP types, SEXP ms) {
-  int cms = INTEGER(ms)[0];
-  int i, j, num_total = LENGTH(statuses);
+/* Create the pollables for `processx_poll()` and
+   `processx_poll_sparse()`. A process has three pollables: stdout,
+   stderr and the poll connection, all others have one.
+
+   Process stdin and connections with queued writes also get a write
+   pollable, after the others, so that polling flushes their queues.
+   These are not part of `*num_poll`, `*num_write` is their number. */
+
+static void processx__poll_add_write(processx_pollable_t *pollables,
+				     int *j, processx_connection_t *ccon) {
+  if (!ccon || processx_c_connection_write_pending(ccon) == 0) return;
+  processx_c_pollable_from_connection_write(&pollables[*j], ccon);
+  (*j)++;
+}
+
+static processx_pollable_t *processx__poll_pollables(SEXP statuses,
+						     SEXP types,
+						     int *num_poll,
+						     int *num_write) {
+  int i, j, w, num_total = LENGTH(statuses);
   processx_pollable_t *pollables;
-  SEXP result;
-  int num_proc = 0, num_poll;
+  int num_proc = 0;
 
   for (i = 0; i < num_total; i++) if (INTEGER(types)[i] == 1) num_proc++;
-  num_poll = num_total + num_proc * 2;
+  *num_poll = num_total + num_proc * 2;
 
   pollables = (processx_pollable_t*)
-    R_alloc(num_poll, sizeof(processx_pollable_t));
+    R_alloc(*num_poll + num_total, sizeof(processx_pollable_t));
 
-  result = PROTECT(allocVector(VECSXP, num_total));
   for (i = 0, j = 0; i < num_total; i++) {
     SEXP status = VECTOR_ELT(statuses, i);
     if (INTEGER(types)[i] == 1) {
@@ -35,31 +49,60 @@ SEXP processx_poll(SEXP statuses, SEXP types, SEXP ms) {
       if (cpollconn) cpollconn->poll_idx = j;
       j++;
 
-      SET_VECTOR_ELT(result, i, allocVector(INTSXP, 3));
-
     } else if (INTEGER(types)[i] == 2) {
       processx_connection_t *handle = R_ExternalPtrAddr(status);
       processx_c_pollable_from_connection(&pollables[j], handle);
       if (handle) handle->poll_idx = j;
       j++;
-      SET_VECTOR_ELT(result, i, allocVector(INTSXP, 1));
 
     } else if (INTEGER(types)[i] == 3) {
       processx_c_pollable_from_curl(&pollables[j], status);
       j++;
-      SET_VECTOR_ELT(result, i, allocVector(INTSXP, 1));
+
+    } else if (INTEGER(types)[i] == 4) {
+      processx_c_pollable_from_process(&pollables[j],
+				       R_ExternalPtrAddr(status));
+      j++;
+    }
+  }
+
+  for (i = 0, w = j; i < num_total; i++) {
+    SEXP status = VECTOR_ELT(statuses, i);
+    if (INTEGER(types)[i] == 1) {
+      processx_handle_t *handle = R_ExternalPtrAddr(VECTOR_ELT(status, 0));
+      processx__poll_add_write(pollables, &w, handle->pipes[0]);
+    } else if (INTEGER(types)[i] == 2) {
+      processx__poll_add_write(pollables, &w, R_ExternalPtrAddr(status));
     }
   }
+  *num_write = w - j;
+
+  return pollables;
+}
+
+SEXP processx_poll(SEXP statuses, SEXP types, SEXP ms) {
+  int cms = INTEGER(ms)[0];
+  int i, j, num_total = LENGTH(statuses);
+  processx_pollable_t *pollables;
+  SEXP result;
+  int num_poll, num_write;
+
+  pollables = processx__poll_pollables(statuses, types, &num_poll,
+				       &num_write);
+
+  result = PROTECT(allocVector(VECSXP, num_total));
+  for (i = 0; i < num_total; i++) {
+    int n = INTEGER(types)[i] == 1 ? 3 : 1;
+    SET_VECTOR_ELT(result, i, allocVector(INTSXP, n));
+  }
 
-  processx_c_connection_poll(pollables, num_poll, cms);
+  processx_c_connection_poll(pollables, num_poll + num_write, cms);
 
   for (i = 0, j = 0; i < num_total; i++) {
     if (INTEGER(types)[i] == 1) {
       INTEGER(VECTOR_ELT(result, i))[0] = pollables[j++].event;
       INTEGER(VECTOR_ELT(result, i))[1] = pollables[j++].event;
       INTEGER(VECTOR_ELT(result, i))[2] = pollables[j++].event;
-    } else if (INTEGER(types)[i] == 2) {
-      INTEGER(VECTOR_ELT(result, i))[0] = pollables[j++].event;
     } else {
       INTEGER(VECTOR_ELT(result, i))[0] = pollables[j++].event;
     }
@@ -68,3 +111,48 @@ SEXP processx_poll(SEXP statuses, SEXP types, SEXP ms) {
   UNPROTECT(1);
   return result;
 }
+
+/* Like `processx_poll()`, but only returns the pollables that have an
+   event (ready, closed, connect or curl event), like a poll set. Closed
+   connections are reported, otherwise polling only closed connections
+   would look like a timeout. The result is a list of two
+   integer vectors: the (one based) indices of the pollables, where a
+   process has three pollables, and their poll codes. */
+
+SEXP processx_poll_sparse(SEXP statuses, SEXP types, SEXP ms) {
+  int cms = INTEGER(ms)[0];
+  int j, k, num_poll, num_write, num_ready = 0;
+  processx_pollable_t *pollables;
+  SEXP result, idx, evs;
+
+  pollables = processx__poll_pollables(statuses, types, &num_poll,
+				       &num_write);
+
+  processx_c_connection_poll(pollables, num_poll + num_write, cms);
+
+  for (j = 0; j < num_poll; j++) {
+    int ev = pollables[j].event;
+    if (ev == PXREADY || ev == PXCLOSED || ev == PXCONNECT ||
+	ev == PXEVENT) {
+      num_ready++;
+    }
+  }
+
+  result = PROTECT(allocVector(VECSXP, 2));
+  idx = PROTECT(allocVector(INTSXP, num_ready));
+  evs = PROTECT(allocVector(INTSXP, num_ready));
+  for (j = 0, k = 0; j < num_poll; j++) {
+    int ev = pollables[j].event;
+    if (ev == PXREADY || ev == PXCLOSED || ev == PXCONNECT ||
+	ev == PXEVENT) {
+      INTEGER(idx)[k] = j + 1;
+      INTEGER(evs)[k] = ev;
+      k++;
+    }
+  }
+  SET_VECTOR_ELT(result, 0, idx);
+  SET_VECTOR_ELT(result, 1, evs);
+
+  UNPROTECT(3);
+  return result;
+}
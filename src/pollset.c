@@ -0,0 +1,409 @@
+#include "processx.h"
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+/* A poll set is a persistent set of pollables. Pollables are added once,
+ * and then the set can be waited on many times. On Linux the fds are
+ * registered in an epoll instance, so a wait costs O(ready) system
+ * work, instead of O(all). Elsewhere we keep the pollable array, and
+ * call `processx_c_connection_poll()` on it.
+ *
+ * The pre-poll functions are only called for the pollables whose
+ * registration can change between waits. A connection might have
+ * buffered data, reach EOF, or be closed, without a system call, so its
+ * pre-poll function runs before every wait. It only looks at memory.
+ * The exit fd of a process does not change once it is registered, and a
+ * finished process stays ready, so exit pollables are only pre-polled
+ * until then. Their pre-poll function blocks SIGCHLD, so a wait does
+ * not make system calls for every process in the set.
+ *
+ * The R objects of the pollables are kept in a list in the protected
+ * field of the external pointer, in the same order as `pollables`.
+ */
+
+typedef struct processx_pollset_s {
+  processx_pollable_t *pollables;
+  int *types;			/* 2: connection, 4: process exit */
+  int *ids;			/* ids, returned to R */
+  int *fds;			/* fd registered in epoll, or -1 */
+  size_t num, size;
+  int next_id;
+#ifdef __linux__
+  int epfd;
+  struct epoll_event *events;
+#endif
+} processx_pollset_t;
+
+static void processx__pollset_free(processx_pollset_t *ps) {
+  if (!ps) return;
+#ifdef __linux__
+  if (ps->epfd >= 0) close(ps->epfd);
+  free(ps->events);
+#endif
+  free(ps->pollables);
+  free(ps->types);
+  free(ps->ids);
+  free(ps->fds);
+  free(ps);
+}
+
+static void processx__pollset_finalizer(SEXP xps) {
+  processx_pollset_t *ps = R_ExternalPtrAddr(xps);
+  processx__pollset_free(ps);
+  R_ClearExternalPtr(xps);
+}
+
+static processx_pollset_t *processx__pollset_get(SEXP xps) {
+  processx_pollset_t *ps = R_ExternalPtrAddr(xps);
+  if (!ps) R_THROW_ERROR("Invalid poll set, already finalized");
+  return ps;
+}
+
+SEXP processx_pollset_create(void) {
+  processx_pollset_t *ps = calloc(1, sizeof(processx_pollset_t));
+  SEXP result;
+
+  if (!ps) R_THROW_ERROR("Cannot create poll set, out of memory");
+  ps->next_id = 1;
+
+#ifdef __linux__
+  ps->epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (ps->epfd == -1) {
+    free(ps);
+    R_THROW_SYSTEM_ERROR("Cannot create poll set");
+  }
+#endif
+
+  result = PROTECT(R_MakeExternalPtr(ps, R_NilValue, allocVector(VECSXP, 0)));
+  R_RegisterCFinalizerEx(result, processx__pollset_finalizer, 1);
+
+  UNPROTECT(1);
+  return result;
+}
+
+static void processx__pollset_grow(SEXP xps, processx_pollset_t *ps) {
+  size_t newsize = ps->size ? ps->size * 2 : 16;
+  size_t i;
+  void *p;
+
+  p = realloc(ps->pollables, newsize * sizeof(processx_pollable_t));
+  if (!p) goto oom;
+  ps->pollables = p;
+  p = realloc(ps->types, newsize * sizeof(int));
+  if (!p) goto oom;
+  ps->types = p;
+  p = realloc(ps->ids, newsize * sizeof(int));
+  if (!p) goto oom;
+  ps->ids = p;
+  p = realloc(ps->fds, newsize * sizeof(int));
+  if (!p) goto oom;
+  ps->fds = p;
+#ifdef __linux__
+  p = realloc(ps->events, newsize * sizeof(struct epoll_event));
+  if (!p) goto oom;
+  ps->events = p;
+#endif
+  ps->size = newsize;
+
+  SEXP old = R_ExternalPtrProtected(xps);
+  SEXP new = PROTECT(allocVector(VECSXP, newsize));
+  for (i = 0; i < ps->num; i++) SET_VECTOR_ELT(new, i, VECTOR_ELT(old, i));
+  R_SetExternalPtrProtected(xps, new);
+  UNPROTECT(1);
+  return;
+
+ oom:
+  R_THROW_ERROR("Cannot grow poll set, out of memory");
+}
+
+#ifdef __linux__
+
+/* `fds[i]` is -1 if nothing is registered, and -2 if the fd cannot be
+   registered, because it is a regular file. These are always ready to
+   read, like poll() reports them. It is also -2 for the exit pollable
+   of a process that has finished already. */
+
+#define PROCESSX__POLLSET_ALWAYS -2
+
+/* If the fd of a connection was closed, then epoll already dropped it,
+   and the same fd number might belong to another pollable now, so we
+   must not call EPOLL_CTL_DEL on it. */
+
+static int processx__pollset_is_closed(processx_pollset_t *ps, size_t i) {
+  processx_connection_t *ccon = ps->pollables[i].object;
+  return ps->types[i] == 2 && (!ccon || ccon->is_closed_);
+}
+
+static void processx__pollset_unregister(processx_pollset_t *ps, size_t i) {
+  if (ps->fds[i] >= 0 && !processx__pollset_is_closed(ps, i)) {
+    epoll_ctl(ps->epfd, EPOLL_CTL_DEL, ps->fds[i], NULL);
+  }
+  ps->fds[i] = -1;
+}
+
+static void processx__pollset_register(processx_pollset_t *ps, size_t i,
+				       int fd) {
+  struct epoll_event ev;
+  if (ps->fds[i] == fd) return;
+  processx__pollset_unregister(ps, i);
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.u64 = i;
+  if (epoll_ctl(ps->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+    if (errno == EPERM) {
+      ps->fds[i] = PROCESSX__POLLSET_ALWAYS;
+      return;
+    }
+    R_THROW_SYSTEM_ERROR("Cannot add fd %d to poll set", fd);
+  }
+  ps->fds[i] = fd;
+}
+
+#endif
+
+/* A relayed connection polls its relay target for writing, when the
+   target is full, see `processx__connection_pre_poll_relay()`. The poll
+   set only registers fds for reading, so we do not support these. */
+
+static void processx__pollset_check_relay(processx_connection_t *ccon) {
+  if (ccon && ccon->relay) {
+    R_THROW_ERROR("Connections with a relay cannot be in a poll set");
+  }
+}
+
+SEXP processx_pollset_add(SEXP xps, SEXP object, SEXP type) {
+  processx_pollset_t *ps = processx__pollset_get(xps);
+  int ctype = INTEGER(type)[0];
+  size_t i, idx = ps->num;
+
+  for (i = 0; i < ps->num; i++) {
+    if (ps->types[i] == ctype &&
+	ps->pollables[i].object == R_ExternalPtrAddr(object)) {
+      R_THROW_ERROR("Object is already in the poll set");
+    }
+  }
+
+  if (ps->num == ps->size) processx__pollset_grow(xps, ps);
+
+  if (ctype == 2) {
+    processx__pollset_check_relay(R_ExternalPtrAddr(object));
+    processx_c_pollable_from_connection(&ps->pollables[idx],
+					R_ExternalPtrAddr(object));
+  } else if (ctype == 4) {
+    processx_c_pollable_from_process(&ps->pollables[idx],
+				     R_ExternalPtrAddr(object));
+  } else {
+    R_THROW_ERROR("Unknown pollable type: %d", ctype);
+  }
+
+  ps->types[idx] = ctype;
+  ps->ids[idx] = ps->next_id++;
+  ps->fds[idx] = -1;
+  SET_VECTOR_ELT(R_ExternalPtrProtected(xps), idx, object);
+  ps->num++;
+
+  return ScalarInteger(ps->ids[idx]);
+}
+
+SEXP processx_pollset_remove(SEXP xps, SEXP id) {
+  processx_pollset_t *ps = processx__pollset_get(xps);
+  SEXP objs = R_ExternalPtrProtected(xps);
+  int cid = INTEGER(id)[0];
+  size_t i, last;
+
+  for (i = 0; i < ps->num; i++) if (ps->ids[i] == cid) break;
+  if (i == ps->num) return ScalarLogical(0);
+
+#ifdef __linux__
+  processx__pollset_unregister(ps, i);
+#endif
+
+  /* Move the last one here */
+  last = ps->num - 1;
+  if (i != last) {
+    ps->pollables[i] = ps->pollables[last];
+    ps->types[i] = ps->types[last];
+    ps->ids[i] = ps->ids[last];
+    ps->fds[i] = ps->fds[last];
+    SET_VECTOR_ELT(objs, i, VECTOR_ELT(objs, last));
+#ifdef __linux__
+    if (ps->fds[i] >= 0 && processx__pollset_is_closed(ps, i)) {
+      ps->fds[i] = -1;
+    } else if (ps->fds[i] >= 0) {
+      struct epoll_event ev;
+      memset(&ev, 0, sizeof(ev));
+      ev.events = EPOLLIN;
+      ev.data.u64 = i;
+      epoll_ctl(ps->epfd, EPOLL_CTL_MOD, ps->fds[i], &ev);
+    }
+#endif
+  }
+  SET_VECTOR_ELT(objs, last, R_NilValue);
+  ps->num--;
+
+  return ScalarLogical(1);
+}
+
+SEXP processx_pollset_size(SEXP xps) {
+  processx_pollset_t *ps = processx__pollset_get(xps);
+  return ScalarInteger((int) ps->num);
+}
+
+/* Only the pollables with an event are returned: their ids and their
+   poll codes, in a list of two integer vectors. */
+
+static SEXP processx__pollset_result(processx_pollset_t *ps, size_t nready) {
+  SEXP result = PROTECT(allocVector(VECSXP, 2));
+  SEXP ids = PROTECT(allocVector(INTSXP, nready));
+  SEXP evs = PROTECT(allocVector(INTSXP, nready));
+  size_t i, j;
+
+  for (i = 0, j = 0; i < ps->num && j < nready; i++) {
+    int ev = ps->pollables[i].event;
+    if (ev == PXREADY || ev == PXCLOSED || ev == PXCONNECT || ev == PXEVENT) {
+      INTEGER(ids)[j] = ps->ids[i];
+      INTEGER(evs)[j] = ev;
+      j++;
+    }
+  }
+
+  SET_VECTOR_ELT(result, 0, ids);
+  SET_VECTOR_ELT(result, 1, evs);
+  UNPROTECT(3);
+  return result;
+}
+
+#ifdef __linux__
+
+static int processx__pollset_epoll_wait(processx_pollset_t *ps, int timeout) {
+  int ret = 0;
+  int timeleft = timeout;
+
+  while (timeout < 0 || timeleft > PROCESSX_INTERRUPT_INTERVAL) {
+    do {
+      ret = epoll_wait(ps->epfd, ps->events, (int) ps->size,
+		       PROCESSX_INTERRUPT_INTERVAL);
+    } while (ret == -1 && errno == EINTR);
+
+    /* If not a timeout, then return */
+    if (ret != 0) return ret;
+
+    R_CheckUserInterrupt();
+    timeleft -= PROCESSX_INTERRUPT_INTERVAL;
+  }
+
+  /* Maybe we are not done, and there is a little left from the timeout */
+  if (timeleft >= 0) {
+    do {
+      ret = epoll_wait(ps->epfd, ps->events, (int) ps->size, timeleft);
+    } while (ret == -1 && errno == EINTR);
+  }
+
+  return ret;
+}
+
+SEXP processx_pollset_wait(SEXP xps, SEXP ms) {
+  processx_pollset_t *ps = processx__pollset_get(xps);
+  int cms = INTEGER(ms)[0];
+  size_t i, nready = 0;
+  int hasdata = 0, nhandles = 0, ret;
+
+  /* Pre-poll, and make sure that the right fds are registered */
+  for (i = 0; i < ps->num; i++) {
+    processx_pollable_t *el = ps->pollables + i;
+    int ev;
+
+    /* Registered or finished exit pollables do not change any more */
+    if (ps->types[i] == 4 && ps->fds[i] != -1) {
+      if (ps->fds[i] == PROCESSX__POLLSET_ALWAYS) {
+	hasdata++;
+	nready++;
+	el->event = PXREADY;
+      } else {
+	el->event = PXSILENT;
+	nhandles++;
+      }
+      continue;
+    }
+
+    if (ps->types[i] == 2) processx__pollset_check_relay(el->object);
+    ev = el->pre_poll_func(el);
+    switch (ev) {
+    case PXHANDLE:
+    case PXWAIT:
+      processx__pollset_register(ps, i, el->handle);
+      if (ps->fds[i] == PROCESSX__POLLSET_ALWAYS) {
+	hasdata++;
+	nready++;
+	el->event = PXREADY;
+      } else {
+	el->event = PXSILENT;
+	nhandles++;
+      }
+      break;
+    case PXREADY:
+    case PXCONNECT:
+      if (ps->types[i] == 4) ps->fds[i] = PROCESSX__POLLSET_ALWAYS;
+      hasdata++;
+      nready++;
+      el->event = ev;
+      break;
+    case PXCLOSED:
+      processx__pollset_unregister(ps, i);
+      nready++;
+      el->event = ev;
+      break;
+    default:
+      processx__pollset_unregister(ps, i);
+      el->event = ev;
+      break;
+    }
+  }
+
+  if (nhandles > 0) {
+    ret = processx__pollset_epoll_wait(ps, hasdata > 0 ? 0 : cms);
+    if (ret == -1) {
+      R_THROW_SYSTEM_ERROR("Processx poll set error");
+    }
+    for (i = 0; i < (size_t) ret; i++) {
+      size_t idx = ps->events[i].data.u64;
+      if (idx < ps->num && ps->pollables[idx].event == PXSILENT) {
+	ps->pollables[idx].event = PXREADY;
+	nready++;
+      }
+    }
+  }
+
+  return processx__pollset_result(ps, nready);
+}
+
+#else
+
+SEXP processx_pollset_wait(SEXP xps, SEXP ms) {
+  processx_pollset_t *ps = processx__pollset_get(xps);
+  int cms = INTEGER(ms)[0];
+  size_t i, nready = 0;
+
+  for (i = 0; i < ps->num; i++) {
+    if (ps->types[i] == 2 && ps->pollables[i].object) {
+      processx_connection_t *ccon = ps->pollables[i].object;
+      processx__pollset_check_relay(ccon);
+      ccon->poll_idx = (int) i;
+    }
+  }
+
+  processx_c_connection_poll(ps->pollables, ps->num, cms);
+
+  for (i = 0; i < ps->num; i++) {
+    int ev = ps->pollables[i].event;
+    if (ev == PXREADY || ev == PXCLOSED || ev == PXCONNECT || ev == PXEVENT) {
+      nready++;
+    }
+  }
+
+  return processx__pollset_result(ps, nready);
+}
+
+#endif
@@ -0,0 +1,520 @@
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "processx.h"
+
+/* Process pools
+ *
+ * A pool has a queue of jobs, and runs at most `max_parallel` of them
+ * at the same time. Whenever a job finishes, the next one is started,
+ * from C, so the scheduling does not need to go through R. Finished jobs
+ * are put on the completion queue, and `processx_pool_wait()` returns
+ * them.
+ *
+ * The exits of the running jobs, and their standard output and error,
+ * are all in a single poll set, that is kept for the life of the pool.
+ * The output is collected in memory, like for `run()`. A job is done
+ * once it has exited, and its output streams are at EOF.
+ *
+ * The protected field of the external pointer is a list: the poll set,
+ * and the list of jobs. A job is a list of its process specification,
+ * see `PROCESSX_EXEC_SPEC_*`, its process handle, once it was started,
+ * and its error message, if it could not be started. We drop this once
+ * the job was returned to R.
+ */
+
+#define PROCESSX__POOL_QUEUED  0
+#define PROCESSX__POOL_RUNNING 1
+#define PROCESSX__POOL_DONE    2
+
+#define PROCESSX__POOL_CHUNK (64 * 1024)
+
+typedef struct processx_pool_stream_s {
+  processx_connection_t *ccon;	/* NULL if not collected, or at EOF */
+  int id;			/* id in the poll set, or -1 */
+  int collect;
+  char *data;
+  size_t size, allocated;
+} processx_pool_stream_t;
+
+typedef struct processx_pool_job_s {
+  int state;
+  int exit_id;			/* id of the exit pollable, or -1 */
+  int timed_out;
+  int failed;			/* could not start it */
+  double timeout;		/* in ms, or -1 */
+  double submitted, started, finished;
+  processx_pool_stream_t streams[2];
+} processx_pool_job_t;
+
+typedef struct processx_pool_s {
+  size_t max_parallel;
+  processx_pool_job_t *jobs;
+  size_t num_jobs, size_jobs;
+  size_t next;			/* the first queued job */
+  size_t *running;		/* has room for `max_parallel` jobs */
+  size_t num_running;
+  size_t *done;			/* completion queue, room for all jobs */
+  size_t num_done;
+  double first_start;
+  size_t completed;
+  double total_wait, total_run;	/* of the completed jobs, in ms */
+} processx_pool_t;
+
+static double processx__pool_now(void) {
+#ifdef _WIN32
+  return (double) GetTickCount64();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+#endif
+}
+
+static void processx__pool_free_job(processx_pool_job_t *job) {
+  free(job->streams[0].data);
+  free(job->streams[1].data);
+  job->streams[0].data = job->streams[1].data = NULL;
+}
+
+static void processx__pool_finalizer(SEXP xpool) {
+  processx_pool_t *pool = R_ExternalPtrAddr(xpool);
+  size_t i;
+  if (!pool) return;
+  for (i = 0; i < pool->num_jobs; i++) {
+    processx__pool_free_job(pool->jobs + i);
+  }
+  free(pool->jobs);
+  free(pool->running);
+  free(pool->done);
+  free(pool);
+  R_ClearExternalPtr(xpool);
+}
+
+static processx_pool_t *processx__pool_get(SEXP xpool) {
+  processx_pool_t *pool = R_ExternalPtrAddr(xpool);
+  if (!pool) R_THROW_ERROR("Invalid process pool, already finalized");
+  return pool;
+}
+
+SEXP processx_pool_create(SEXP max_parallel) {
+  processx_pool_t *pool = calloc(1, sizeof(processx_pool_t));
+  SEXP result, prot;
+
+  if (!pool) R_THROW_ERROR("Cannot create process pool, out of memory");
+  pool->max_parallel = INTEGER(max_parallel)[0];
+  pool->running = calloc(pool->max_parallel, sizeof(size_t));
+  if (!pool->running) {
+    free(pool);
+    R_THROW_ERROR("Cannot create process pool, out of memory");
+  }
+
+  prot = PROTECT(allocVector(VECSXP, 2));
+  SET_VECTOR_ELT(prot, 0, processx_pollset_create());
+  SET_VECTOR_ELT(prot, 1, allocVector(VECSXP, 0));
+  result = PROTECT(R_MakeExternalPtr(pool, R_NilValue, prot));
+  R_RegisterCFinalizerEx(result, processx__pool_finalizer, 1);
+
+  UNPROTECT(2);
+  return result;
+}
+
+/* `spec` is the process specification, `collect` is two
+   logicals, for collecting the standard output and error, and `timeout`
+   is in milliseconds, negative for no timeout. Returns the job id. */
+
+SEXP processx_pool_submit(SEXP xpool, SEXP spec, SEXP collect,
+			  SEXP timeout) {
+  processx_pool_t *pool = processx__pool_get(xpool);
+  SEXP prot = R_ExternalPtrProtected(xpool);
+  processx_pool_job_t *job;
+  SEXP rjob;
+
+  if (pool->num_jobs == pool->size_jobs) {
+    size_t i, newsize = pool->size_jobs ? pool->size_jobs * 2 : 16;
+    SEXP old = VECTOR_ELT(prot, 1), new;
+    void *p = realloc(pool->jobs, newsize * sizeof(processx_pool_job_t));
+    if (!p) R_THROW_ERROR("Cannot submit job, out of memory");
+    pool->jobs = p;
+    p = realloc(pool->done, newsize * sizeof(size_t));
+    if (!p) R_THROW_ERROR("Cannot submit job, out of memory");
+    pool->done = p;
+    pool->size_jobs = newsize;
+
+    new = PROTECT(allocVector(VECSXP, newsize));
+    for (i = 0; i < pool->num_jobs; i++) {
+      SET_VECTOR_ELT(new, i, VECTOR_ELT(old, i));
+    }
+    SET_VECTOR_ELT(prot, 1, new);
+    UNPROTECT(1);
+  }
+
+  rjob = PROTECT(allocVector(VECSXP, 3));
+  SET_VECTOR_ELT(rjob, 0, spec);
+  SET_VECTOR_ELT(VECTOR_ELT(prot, 1), pool->num_jobs, rjob);
+  UNPROTECT(1);
+
+  job = pool->jobs + pool->num_jobs;
+  memset(job, 0, sizeof(processx_pool_job_t));
+  job->state = PROCESSX__POOL_QUEUED;
+  job->exit_id = -1;
+  job->timeout = REAL(timeout)[0];
+  job->submitted = processx__pool_now();
+  job->streams[0].id = job->streams[1].id = -1;
+  job->streams[0].collect = LOGICAL(collect)[0];
+  job->streams[1].collect = LOGICAL(collect)[1];
+  pool->num_jobs++;
+
+  return ScalarInteger((int) pool->num_jobs);
+}
+
+static void processx__pool_done(processx_pool_t *pool, size_t idx) {
+  processx_pool_job_t *job = pool->jobs + idx;
+  size_t i;
+
+  job->state = PROCESSX__POOL_DONE;
+  job->finished = processx__pool_now();
+  pool->done[pool->num_done++] = idx;
+  pool->completed++;
+  pool->total_wait += job->started - job->submitted;
+  pool->total_run += job->finished - job->started;
+
+  for (i = 0; i < pool->num_running; i++) {
+    if (pool->running[i] == idx) {
+      pool->running[i] = pool->running[--pool->num_running];
+      break;
+    }
+  }
+}
+
+static int processx__pool_add(SEXP xps, SEXP object, int type) {
+  SEXP xtype = PROTECT(ScalarInteger(type));
+  int id = INTEGER(processx_pollset_add(xps, object, xtype))[0];
+  UNPROTECT(1);
+  return id;
+}
+
+static void processx__pool_remove(SEXP xps, int *id) {
+  SEXP xid = PROTECT(ScalarInteger(*id));
+  processx_pollset_remove(xps, xid);
+  UNPROTECT(1);
+  *id = -1;
+}
+
+/* Start a job, and catch all errors, like `try(silent = TRUE)`: turn off
+   the error messages, and take the message from the error buffer,
+   without the "Error in <call> :" prefix. Returns the process handle,
+   or R_NilValue, and then the error message is in `msg`. */
+
+typedef struct {
+  SEXP spec;
+  char *msg;
+  size_t msg_size;
+  SEXP result;
+} processx__pool_exec_t;
+
+static void processx__pool_exec_body(void *data) {
+  processx__pool_exec_t *ex = data;
+  ex->result = processx__exec_spec(ex->spec, ex->msg, ex->msg_size);
+}
+
+static SEXP processx__pool_exec(SEXP spec, char *msg, size_t msg_size) {
+  processx__pool_exec_t ex = { spec, msg, msg_size, R_NilValue };
+  SEXP call, old;
+  Rboolean ok;
+  const char *err, *colon;
+  size_t len;
+
+  msg[0] = '\0';
+  call = PROTECT(lang2(install("options"), ScalarLogical(FALSE)));
+  SET_TAG(CDR(call), install("show.error.messages"));
+  old = PROTECT(eval(call, R_BaseEnv));
+  ok = R_ToplevelExec(processx__pool_exec_body, &ex);
+  PROTECT(ex.result);
+  SETCADR(call, old);
+  SET_TAG(CDR(call), R_NilValue);
+  eval(call, R_BaseEnv);
+  UNPROTECT(3);
+
+  if (ok) return ex.result;
+
+  err = R_curErrorBuf();
+  colon = strchr(err, ':');
+  if (colon) err = colon + 1;
+  while (*err == ' ' || *err == '\n') err++;
+  len = strlen(err);
+  while (len > 0 && err[len - 1] == '\n') len--;
+  snprintf(msg, msg_size, "%.*s", (int) len, err);
+  if (msg[0] == '\0') {
+    snprintf(msg, msg_size, "cannot start processx process");
+  }
+  return R_NilValue;
+}
+
+/* Start queued jobs, while there is room. If a job cannot be started,
+   then it is done, with an NA exit status and the error message. */
+
+static void processx__pool_start(SEXP xpool, processx_pool_t *pool) {
+  SEXP prot = R_ExternalPtrProtected(xpool);
+  SEXP xps = VECTOR_ELT(prot, 0), jobs = VECTOR_ELT(prot, 1);
+  static const char *names[] = { "stdout_pipe", "stderr_pipe" };
+
+  while (pool->num_running < pool->max_parallel &&
+	 pool->next < pool->num_jobs) {
+    size_t idx = pool->next++;
+    processx_pool_job_t *job = pool->jobs + idx;
+    SEXP rjob = VECTOR_ELT(jobs, idx);
+    SEXP spec = VECTOR_ELT(rjob, 0);
+    SEXP handle, private_ = VECTOR_ELT(spec, PROCESSX_EXEC_SPEC_PRIVATE);
+    char msg[1024];
+    int i;
+
+    job->started = processx__pool_now();
+    if (pool->first_start == 0) pool->first_start = job->started;
+    handle = processx__pool_exec(spec, msg, sizeof(msg));
+    if (isNull(handle)) {
+      job->failed = 1;
+      SET_VECTOR_ELT(rjob, 2, mkString(msg));
+      processx__pool_done(pool, idx);
+      continue;
+    }
+    SET_VECTOR_ELT(rjob, 1, handle);
+
+    job->state = PROCESSX__POOL_RUNNING;
+    pool->running[pool->num_running++] = idx;
+    job->exit_id = processx__pool_add(xps, handle, 4);
+    for (i = 0; i < 2; i++) {
+      processx_pool_stream_t *stream = job->streams + i;
+      SEXP con;
+      if (!stream->collect) continue;
+      con = findVarInFrame(private_, install(names[i]));
+      if (con == R_UnboundValue || isNull(con)) continue;
+      stream->ccon = R_ExternalPtrAddr(con);
+      stream->id = processx__pool_add(xps, con, 2);
+    }
+  }
+}
+
+/* Read everything that is available, without waiting */
+
+static void processx__pool_drain(SEXP xps, processx_pool_stream_t *stream) {
+  for (;;) {
+    ssize_t n;
+    if (stream->allocated - stream->size < PROCESSX__POOL_CHUNK) {
+      size_t newsize = stream->allocated ? stream->allocated * 2 :
+	PROCESSX__POOL_CHUNK * 2;
+      char *newdata = realloc(stream->data, newsize);
+      if (!newdata) R_THROW_ERROR("Cannot collect output, out of memory");
+      stream->data = newdata;
+      stream->allocated = newsize;
+    }
+    n = processx_c_connection_read_chars(
+      stream->ccon, stream->data + stream->size, PROCESSX__POOL_CHUNK);
+    if (n <= 0) break;
+    stream->size += n;
+  }
+
+  if (processx_c_connection_is_eof(stream->ccon)) {
+    processx__pool_remove(xps, &stream->id);
+    stream->ccon = NULL;
+  }
+}
+
+/* Handle the events of the poll set. A job is done once it exited and
+   its output is all read. Returns the time until the next job timeout,
+   or -1 if there are no timeouts. */
+
+static double processx__pool_update(SEXP xpool, processx_pool_t *pool,
+				    SEXP events) {
+  SEXP prot = R_ExternalPtrProtected(xpool);
+  SEXP xps = VECTOR_ELT(prot, 0), jobs = VECTOR_ELT(prot, 1);
+  SEXP ids = events == R_NilValue ? R_NilValue : VECTOR_ELT(events, 0);
+  R_xlen_t e, nev = isNull(ids) ? 0 : XLENGTH(ids);
+  double now = processx__pool_now(), next = -1;
+  size_t r;
+
+  for (e = 0; e < nev; e++) {
+    int id = INTEGER(ids)[e];
+    for (r = 0; r < pool->num_running; r++) {
+      processx_pool_job_t *job = pool->jobs + pool->running[r];
+      if (job->exit_id == id) {
+	processx__pool_remove(xps, &job->exit_id);
+	break;
+      } else if (job->streams[0].id == id) {
+	processx__pool_drain(xps, job->streams);
+	break;
+      } else if (job->streams[1].id == id) {
+	processx__pool_drain(xps, job->streams + 1);
+	break;
+      }
+    }
+  }
+
+  r = 0;
+  while (r < pool->num_running) {
+    size_t idx = pool->running[r];
+    processx_pool_job_t *job = pool->jobs + idx;
+    if (job->exit_id == -1 && job->streams[0].id == -1 &&
+	job->streams[1].id == -1) {
+      /* Moves the last running job to position `r` */
+      processx__pool_done(pool, idx);
+      continue;
+    }
+    if (job->timeout >= 0 && !job->timed_out) {
+      double left = job->started + job->timeout - now;
+      if (left <= 0) {
+	SEXP handle = VECTOR_ELT(VECTOR_ELT(jobs, idx), 1);
+	SEXP grace = PROTECT(ScalarReal(0));
+	job->timed_out = 1;
+	processx_kill(handle, grace, R_NilValue);
+	UNPROTECT(1);
+      } else if (next < 0 || left < next) {
+	next = left;
+      }
+    }
+    r++;
+  }
+
+  return next;
+}
+
+static SEXP processx__pool_stream_result(processx_pool_stream_t *stream) {
+  if (!stream->collect) return R_NilValue;
+  if (stream->size > INT_MAX) {
+    R_THROW_ERROR("Output is too long for an R string, %.0f bytes",
+		  (double) stream->size);
+  }
+  return ScalarString(mkCharLenCE(stream->data ? stream->data : "",
+				  (int) stream->size, CE_UTF8));
+}
+
+/* Return the completed jobs, and forget about them */
+
+static SEXP processx__pool_results(SEXP xpool, processx_pool_t *pool) {
+  static const char *names[] = {
+    "id", "status", "stdout", "stderr", "timeout", "wait_time",
+    "run_time", "error", ""
+  };
+  SEXP jobs = VECTOR_ELT(R_ExternalPtrProtected(xpool), 1);
+  SEXP result = PROTECT(allocVector(VECSXP, pool->num_done));
+  size_t i;
+
+  for (i = 0; i < pool->num_done; i++) {
+    size_t idx = pool->done[i];
+    processx_pool_job_t *job = pool->jobs + idx;
+    SEXP rjob = VECTOR_ELT(jobs, idx);
+    SEXP handle = VECTOR_ELT(rjob, 1);
+    SEXP res = PROTECT(mkNamed(VECSXP, names));
+    SET_VECTOR_ELT(res, 0, ScalarInteger((int) idx + 1));
+    if (job->failed) {
+      SET_VECTOR_ELT(res, 1, ScalarInteger(NA_INTEGER));
+    } else {
+      SET_VECTOR_ELT(res, 1, processx_get_exit_status(handle, R_NilValue));
+    }
+    SET_VECTOR_ELT(res, 2, processx__pool_stream_result(job->streams));
+    SET_VECTOR_ELT(res, 3, processx__pool_stream_result(job->streams + 1));
+    SET_VECTOR_ELT(res, 4, ScalarLogical(job->timed_out));
+    SET_VECTOR_ELT(res, 5, ScalarReal((job->started - job->submitted) / 1000));
+    SET_VECTOR_ELT(res, 6, ScalarReal((job->finished - job->started) / 1000));
+    SET_VECTOR_ELT(res, 7, VECTOR_ELT(rjob, 2));
+    SET_VECTOR_ELT(result, i, res);
+    UNPROTECT(1);
+  }
+
+  for (i = 0; i < pool->num_done; i++) {
+    size_t idx = pool->done[i];
+    processx__pool_free_job(pool->jobs + idx);
+    SET_VECTOR_ELT(jobs, idx, R_NilValue);
+  }
+  pool->num_done = 0;
+
+  UNPROTECT(1);
+  return result;
+}
+
+/* Run the pool until at least one job is done, or the timeout expires.
+   `ms` is -1 for no timeout. Returns the list of completed jobs, it is
+   empty on timeout, or if there are no jobs. */
+
+SEXP processx_pool_wait(SEXP xpool, SEXP ms) {
+  processx_pool_t *pool = processx__pool_get(xpool);
+  SEXP xps = VECTOR_ELT(R_ExternalPtrProtected(xpool), 0);
+  int cms = INTEGER(ms)[0];
+  double deadline = cms < 0 ? 0 : processx__pool_now() + cms;
+  SEXP events = R_NilValue;
+
+  for (;;) {
+    double next, left = -1;
+    SEXP xms;
+
+    /* Start jobs before and after the update, so we start a new job as
+       soon as one is done. */
+    processx__pool_start(xpool, pool);
+    next = processx__pool_update(xpool, pool, events);
+    if (events != R_NilValue) UNPROTECT(1);
+    events = R_NilValue;
+    processx__pool_start(xpool, pool);
+    if (pool->num_done > 0 || pool->num_running == 0) break;
+
+    if (cms >= 0) {
+      left = deadline - processx__pool_now();
+      if (left <= 0) break;
+    }
+    if (next >= 0 && (left < 0 || next < left)) left = next;
+
+    xms = PROTECT(ScalarInteger(left < 0 ? -1 : (int) left + 1));
+    events = processx_pollset_wait(xps, xms);
+    UNPROTECT(1);
+    PROTECT(events);
+  }
+
+  return processx__pool_results(xpool, pool);
+}
+
+/* Kill the running jobs, and drop the queued ones. The killed jobs are
+   still returned by the next wait. */
+
+SEXP processx_pool_kill(SEXP xpool) {
+  processx_pool_t *pool = processx__pool_get(xpool);
+  SEXP jobs = VECTOR_ELT(R_ExternalPtrProtected(xpool), 1);
+  SEXP grace = PROTECT(ScalarReal(0));
+  size_t i;
+
+  for (i = pool->next; i < pool->num_jobs; i++) {
+    pool->jobs[i].state = PROCESSX__POOL_DONE;
+    SET_VECTOR_ELT(jobs, i, R_NilValue);
+  }
+  pool->next = pool->num_jobs;
+
+  for (i = 0; i < pool->num_running; i++) {
+    SEXP handle = VECTOR_ELT(VECTOR_ELT(jobs, pool->running[i]), 1);
+    processx_kill(handle, grace, R_NilValue);
+  }
+
+  UNPROTECT(1);
+  return R_NilValue;
+}
+
+/* Number of submitted, queued, running and completed jobs, the time
+   since the first job was started, and the total queue waiting time
+   and running time of the completed jobs. Times are in seconds. */
+
+SEXP processx_pool_stats(SEXP xpool) {
+  processx_pool_t *pool = processx__pool_get(xpool);
+  SEXP result = PROTECT(allocVector(REALSXP, 7));
+  double now = processx__pool_now();
+
+  REAL(result)[0] = pool->num_jobs;
+  REAL(result)[1] = pool->num_jobs - pool->next;
+  REAL(result)[2] = pool->num_running;
+  REAL(result)[3] = pool->completed;
+  REAL(result)[4] = pool->first_start == 0 ? 0 :
+    (now - pool->first_start) / 1000;
+  REAL(result)[5] = pool->total_wait / 1000;
+  REAL(result)[6] = pool->total_run / 1000;
+
+  UNPROTECT(1);
+  return result;
+}
@@ -4,16 +4,23 @@
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <limits.h>
+#include <stdint.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <stdlib.h>
 
 #ifndef _WIN32
+#include <fcntl.h>
+#include <langinfo.h>
+#include <strings.h>
 #include <sys/uio.h>
+#include <sys/ioctl.h>
 #include <poll.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <time.h>
 #else
 #include <io.h>
 #endif
@@ -41,19 +48,36 @@ static void processx__connection_find_lines(processx_connection_t *ccon,
 
 static void processx__connection_alloc(processx_connection_t *ccon);
 static void processx__connection_realloc(processx_connection_t *ccon);
+static void processx__connection_shrink(processx_connection_t *ccon);
+static void processx__connection_drained(processx_connection_t *ccon);
 static ssize_t processx__connection_read(processx_connection_t *ccon);
+static size_t processx__connection_read_raw(processx_connection_t *ccon,
+					    void *buf, size_t nbytes);
+static size_t processx__connection_available(processx_connection_t *ccon);
 static ssize_t processx__find_newline(processx_connection_t *ccon,
 				      size_t start);
+static void processx__connection_consume_utf8(processx_connection_t *ccon,
+					      size_t nbytes);
+static void processx__connection_consume_raw(processx_connection_t *ccon,
+					     size_t nbytes);
+static void processx__connection_compact_raw(processx_connection_t *ccon,
+					     int force);
+static void processx__connection_compact_utf8(processx_connection_t *ccon,
+					      int force);
 static ssize_t processx__connection_read_until_newline(processx_connection_t
 						       *ccon);
 static void processx__connection_xfinalizer(SEXP con);
 static ssize_t processx__connection_to_utf8(processx_connection_t *ccon);
+static int processx__encoding_is_utf8(const char *encoding);
 static void processx__connection_find_utf8_chars(processx_connection_t *ccon,
 						 ssize_t maxchars,
 						 ssize_t maxbytes,
 						 size_t *chars,
 						 size_t *bytes);
 
+static void processx__connection_drop_queue(processx_connection_t *ccon);
+int processx_i_pre_poll_func_connection(processx_pollable_t *pollable);
+
 #ifdef _WIN32
 #define PROCESSX_CHECK_VALID_CONN(x) do {				\
     if (!x) R_THROW_ERROR("Invalid connection object");                 \
@@ -159,10 +183,9 @@ SEXP processx_connection_read_chars(SEXP con, SEXP nchars) {
   processx__connection_find_chars(ccon, cnchars, -1, &utf8_chars,
 				  &utf8_bytes);
 
-  result = PROTECT(ScalarString(mkCharLenCE(ccon->utf8, (int) utf8_bytes,
-					    CE_UTF8)));
-  ccon->utf8_data_size -= utf8_bytes;
-  memmove(ccon->utf8, ccon->utf8 + utf8_bytes, ccon->utf8_data_size);
+  result = PROTECT(ScalarString(mkCharLenCE(utf8_bytes ? ccon->utf8 : "",
+					    (int) utf8_bytes, CE_UTF8)));
+  processx__connection_consume_utf8(ccon, utf8_bytes);
 
   UNPROTECT(1);
   return result;
@@ -173,16 +196,22 @@ SEXP processx_connection_read_bytes(SEXP con, SEXP nbytes) {
   processx_connection_t *ccon = R_ExternalPtrAddr(con);
   SEXP result;
   int cnbytes = asInteger(nbytes);
-  size_t to_read;
+  size_t to_read, got;
 
   PROCESSX_CHECK_VALID_CONN(ccon);
 
   /* Switch to raw mode — bypasses UTF-8 conversion from here on */
   ccon->raw_mode = 1;
 
-  /* Fill the buffer from the OS if it is empty and not at EOF */
-  if (ccon->buffer_data_size == 0 && !ccon->is_eof_raw_) {
-    processx__connection_read(ccon);
+  /* If we know how much data the OS has, then we read it directly into
+     the result, otherwise fill the buffer first. */
+  to_read = ccon->buffer_data_size;
+  if (to_read == 0 && !ccon->is_eof_raw_) {
+    to_read = processx__connection_available(ccon);
+    if (to_read == 0) {
+      processx__connection_read(ccon);
+      to_read = ccon->buffer_data_size;
+    }
   }
 
   /* Update EOF for raw mode: done when the OS-level stream is exhausted
@@ -191,14 +220,15 @@ SEXP processx_connection_read_bytes(SEXP con, SEXP nbytes) {
     ccon->is_eof_ = 1;
   }
 
-  to_read = ccon->buffer_data_size;
   if (cnbytes >= 0 && (size_t) cnbytes < to_read) to_read = (size_t) cnbytes;
 
   result = PROTECT(allocVector(RAWSXP, to_read));
-  if (to_read > 0) {
-    memcpy(RAW(result), ccon->buffer, to_read);
-    ccon->buffer_data_size -= to_read;
-    memmove(ccon->buffer, ccon->buffer + to_read, ccon->buffer_data_size);
+  got = to_read > 0 ? processx__connection_read_raw(ccon, RAW(result), to_read) : 0;
+  if (got < to_read) {
+    SEXP result2 = PROTECT(allocVector(RAWSXP, got));
+    if (got > 0) memcpy(RAW(result2), RAW(result), got);
+    UNPROTECT(2);
+    return result2;
   }
 
   UNPROTECT(1);
@@ -236,15 +266,167 @@ SEXP processx_connection_read_lines(SEXP con, SEXP nlines) {
 		  (int) (eol - newline), CE_UTF8));
   }
 
-  if (eol >= 0) {
-    ccon->utf8_data_size -= eol + 1;
-    memmove(ccon->utf8, ccon->utf8 + eol + 1, ccon->utf8_data_size);
-  }
+  if (eol >= 0) processx__connection_consume_utf8(ccon, eol + 1);
 
   UNPROTECT(1);
   return result;
 }
 
+/* Make room in the buffer of `read_all`, it grows geometrically */
+
+static SEXP processx__read_all_reserve(SEXP acc, PROTECT_INDEX ipx,
+				       size_t size, size_t nbytes) {
+  size_t alloc = XLENGTH(acc);
+  if (size + nbytes > alloc) {
+    SEXP newacc;
+    while (size + nbytes > alloc) alloc = alloc ? alloc * 2 : 64 * 1024;
+    newacc = allocVector(RAWSXP, alloc);
+    memcpy(RAW(newacc), RAW(acc), size);
+    REPROTECT(acc = newacc, ipx);
+  }
+  return acc;
+}
+
+SEXP processx_connection_read_all(SEXP con, SEXP what) {
+  processx_connection_t *ccon = R_ExternalPtrAddr(con);
+  int cwhat = asInteger(what);
+  processx_pollable_t pollable;
+  PROTECT_INDEX ipx;
+  SEXP acc, result;
+  size_t size = 0;
+
+  PROCESSX_CHECK_VALID_CONN(ccon);
+  if (cwhat == 2) ccon->raw_mode = 1;
+
+  PROTECT_WITH_INDEX(acc = allocVector(RAWSXP, 0), &ipx);
+  processx_c_pollable_from_connection(&pollable, ccon);
+
+  for (;;) {
+    if (ccon->raw_mode) {
+      /* Read directly into the result buffer, if possible */
+      size_t got;
+      acc = processx__read_all_reserve(acc, ipx, size, 64 * 1024);
+      got = processx__connection_read_raw(ccon, RAW(acc) + size,
+					  XLENGTH(acc) - size);
+      size += got;
+      if (ccon->is_eof_) break;
+      if (got > 0) continue;
+
+    } else {
+      if (ccon->utf8_data_size > 0) {
+	acc = processx__read_all_reserve(acc, ipx, size, ccon->utf8_data_size);
+	memcpy(RAW(acc) + size, ccon->utf8, ccon->utf8_data_size);
+	size += ccon->utf8_data_size;
+	processx__connection_consume_utf8(ccon, ccon->utf8_data_size);
+      }
+      processx__connection_read(ccon);
+      if (ccon->is_eof_) break;
+      if (ccon->utf8_data_size > 0) continue;
+    }
+
+    processx_c_connection_poll(&pollable, 1, -1);
+  }
+
+  if (cwhat == 2) {
+    result = PROTECT(allocVector(RAWSXP, size));
+    if (size > 0) memcpy(RAW(result), RAW(acc), size);
+
+  } else if (cwhat == 0) {
+    if (size > INT_MAX) {
+      R_THROW_ERROR("Output is too long for an R string, %.0f bytes",
+		    (double) size);
+    }
+    result = PROTECT(ScalarString(mkCharLenCE((const char*) RAW(acc),
+					      (int) size, CE_UTF8)));
+
+  } else {
+    const char *data = (const char*) RAW(acc), *nl, *start = data;
+    const char *end = data + size;
+    size_t l, nlines = 0;
+    int slashr;
+
+    for (nl = start; nl < end && (nl = memchr(nl, '\n', end - nl)); nl++) {
+      nlines++;
+    }
+    result = PROTECT(allocVector(STRSXP, nlines + (size > 0 &&
+						    data[size - 1] != '\n')));
+    for (l = 0; l < nlines; l++) {
+      nl = memchr(start, '\n', end - start);
+      slashr = nl > start && nl[-1] == '\r';
+      SET_STRING_ELT(
+        result, l,
+	mkCharLenCE(start, (int) (nl - start - slashr), CE_UTF8));
+      start = nl + 1;
+    }
+    if (start < end) {
+      SET_STRING_ELT(result, l, mkCharLenCE(start, (int) (end - start),
+					    CE_UTF8));
+    }
+  }
+
+  UNPROTECT(2);
+  return result;
+}
+
+SEXP processx_connection_write_queue(SEXP con, SEXP bytes) {
+  processx_connection_t *ccon = R_ExternalPtrAddr(con);
+  size_t pending = processx_c_connection_write_queue(ccon, RAW(bytes),
+						     LENGTH(bytes));
+  return ScalarReal((double) pending);
+}
+
+SEXP processx_connection_write_pending(SEXP con) {
+  processx_connection_t *ccon = R_ExternalPtrAddr(con);
+  if (!ccon) R_THROW_ERROR("Invalid connection object");
+  return ScalarReal((double) processx_c_connection_flush(ccon));
+}
+
+SEXP processx_connection_relay(SEXP from, SEXP to, SEXP nbytes) {
+  processx_connection_t *cfrom = R_ExternalPtrAddr(from);
+  processx_connection_t *cto = R_ExternalPtrAddr(to);
+  double cnbytes = REAL(nbytes)[0];
+  size_t todo = R_FINITE(cnbytes) ? (size_t) cnbytes : SIZE_MAX;
+  int blocked;
+  PROCESSX_CHECK_VALID_CONN(cfrom);
+  PROCESSX_CHECK_VALID_CONN(cto);
+  if (cto == cfrom) R_THROW_ERROR("Cannot relay a connection to itself");
+  return ScalarReal((double)
+    processx_c_connection_relay(cfrom, cto, todo, &blocked));
+}
+
+/* The relay target is kept alive in the protected field of the external
+   pointer of the source, in a cons cell tagged `relay`, whose CDR is
+   what was there before, so we do not drop that reference. */
+
+static void processx__connection_keep_relay(SEXP from, SEXP to) {
+  SEXP sym = install("relay");
+  SEXP prot = R_ExternalPtrProtected(from);
+  if (TYPEOF(prot) == LISTSXP && TAG(prot) == sym) {
+    SETCAR(prot, to);
+  } else if (!isNull(to)) {
+    prot = PROTECT(CONS(to, prot));
+    SET_TAG(prot, sym);
+    R_SetExternalPtrProtected(from, prot);
+    UNPROTECT(1);
+  }
+}
+
+SEXP processx_connection_set_relay(SEXP from, SEXP to) {
+  processx_connection_t *cfrom = R_ExternalPtrAddr(from);
+  PROCESSX_CHECK_VALID_CONN(cfrom);
+  if (isNull(to)) {
+    cfrom->relay = NULL;
+  } else {
+    processx_connection_t *cto = R_ExternalPtrAddr(to);
+    PROCESSX_CHECK_VALID_CONN(cto);
+    if (cto == cfrom) R_THROW_ERROR("Cannot relay a connection to itself");
+    cfrom->relay = cto;
+  }
+  /* Keep the target alive while it is in use */
+  processx__connection_keep_relay(from, to);
+  return R_NilValue;
+}
+
 SEXP processx_connection_write_bytes(SEXP con, SEXP bytes) {
   processx_connection_t *ccon = R_ExternalPtrAddr(con);
   Rbyte *cbytes = RAW(bytes);
@@ -759,6 +941,37 @@ SEXP processx_connection_set_stderr(SEXP con, SEXP drop) {
   return processx__connection_set_std(con, 2, LOGICAL(drop)[0]);
 }
 
+SEXP processx_connection_background_read(SEXP con) {
+  processx_connection_t *ccon = R_ExternalPtrAddr(con);
+  if (!ccon) R_THROW_ERROR("Invalid connection object");
+  if (ccon->is_closed_) R_THROW_ERROR("Connection is closed");
+
+#ifdef _WIN32
+  /* Not needed on Windows, there is always an overlapped read pending,
+     see processx__connection_start_read() */
+  return ScalarLogical(0);
+#else
+  return ScalarLogical(processx__bgread_start(ccon));
+#endif
+}
+
+SEXP processx_connection_set_buffer_policy(SEXP con, SEXP initial, SEXP max,
+					   SEXP growth, SEXP shrink) {
+  processx_connection_t *ccon = R_ExternalPtrAddr(con);
+  processx_buffer_policy_t policy;
+  double cmax = REAL(max)[0];
+
+  if (!ccon) R_THROW_ERROR("Invalid connection object");
+
+  policy.initial = (size_t) REAL(initial)[0];
+  policy.max = R_FINITE(cmax) ? (size_t) cmax : 0;
+  policy.growth = REAL(growth)[0];
+  policy.shrink = LOGICAL(shrink)[0];
+  processx_c_connection_set_buffer_policy(ccon, &policy);
+
+  return R_NilValue;
+}
+
 SEXP processx_connection_get_fileno(SEXP con) {
   processx_connection_t *ccon = R_ExternalPtrAddr(con);
   if (!ccon) R_THROW_ERROR("Invalid connection object");
@@ -857,12 +1070,34 @@ processx_connection_t *processx_c_connection_create(
   con->raw_mode = 0;
 
   con->buffer = 0;
+  con->buffer_base = 0;
   con->buffer_allocated_size = 0;
   con->buffer_data_size = 0;
+  con->buffer_pooled = 0;
 
   con->utf8 = 0;
+  con->utf8_base = 0;
+  con->utf8_pooled = 0;
   con->utf8_allocated_size = 0;
   con->utf8_data_size = 0;
+  con->utf8_scanned = 0;
+
+  con->buffer_policy.initial = PROCESSX_BUFFER_INITIAL;
+  con->buffer_policy.max = 0;
+  con->buffer_policy.growth = PROCESSX_BUFFER_GROWTH;
+  con->buffer_policy.shrink = 0;
+
+  con->wqueue = 0;
+  con->wqueue_start = 0;
+  con->wqueue_size = 0;
+  con->wqueue_allocated = 0;
+  con->write_error = 0;
+  con->relay = 0;
+
+  con->utf8_passthrough = 0;
+  if (!encoding || strcmp(encoding, "binary") != 0) {
+    con->utf8_passthrough = processx__encoding_is_utf8(encoding);
+  }
 
   con->encoding = 0;
   if (encoding && encoding[0]) {
@@ -898,6 +1133,7 @@ processx_connection_t *processx_c_connection_create(
   con->handle.freelist = FALSE;
 #else
   con->handle = os_handle;
+  con->bgread = 0;
 #endif
 
   if (r_connection) {
@@ -913,6 +1149,22 @@ processx_connection_t *processx_c_connection_create(
 }
 
 /* Destroy */
+void processx_c_connection_set_buffer_policy(
+  processx_connection_t *ccon,
+  const processx_buffer_policy_t *policy) {
+
+  ccon->buffer_policy = *policy;
+  /* We need room for at least one UTF8 character and a terminating zero */
+  if (ccon->buffer_policy.initial < 16) ccon->buffer_policy.initial = 16;
+  if (ccon->buffer_policy.max > 0 &&
+      ccon->buffer_policy.max < ccon->buffer_policy.initial) {
+    ccon->buffer_policy.max = ccon->buffer_policy.initial;
+  }
+  if (!(ccon->buffer_policy.growth > 1.0)) {
+    ccon->buffer_policy.growth = PROCESSX_BUFFER_GROWTH;
+  }
+}
+
 void processx_c_connection_destroy(processx_connection_t *ccon) {
 
   if (!ccon) return;
@@ -929,13 +1181,20 @@ void processx_c_connection_destroy(processx_connection_t *ccon) {
   if (processx__connection_schedule_destroy(ccon)) return;
 #endif
 
+#ifndef _WIN32
+  processx__bgread_stop(ccon);
+#endif
+
   if (ccon->iconv_ctx) {
     Riconv_close(ccon->iconv_ctx);
     ccon->iconv_ctx = NULL;
   }
 
-  if (ccon->buffer) { free(ccon->buffer); ccon->buffer = NULL; }
-  if (ccon->utf8) { free(ccon->utf8); ccon->utf8 = NULL; }
+  processx__pool_free(ccon->buffer_base, ccon->buffer_pooled);
+  ccon->buffer = ccon->buffer_base = NULL;
+  processx__pool_free(ccon->utf8_base, ccon->utf8_pooled);
+  ccon->utf8 = ccon->utf8_base = NULL;
+  processx__connection_drop_queue(ccon);
   if (ccon->encoding) { free(ccon->encoding); ccon->encoding = NULL; }
   if (ccon->filename) { free(ccon->filename); ccon->filename = NULL; }
 
@@ -949,6 +1208,14 @@ void processx_c_connection_destroy(processx_connection_t *ccon) {
   free(ccon);
 }
 
+/* Read bytes */
+ssize_t processx_c_connection_read_bytes(processx_connection_t *ccon,
+					 void *buffer,
+					 size_t nbytes) {
+  PROCESSX_CHECK_VALID_CONN(ccon);
+  return processx__connection_read_raw(ccon, buffer, nbytes);
+}
+
 /* Read characters */
 ssize_t processx_c_connection_read_chars(processx_connection_t *ccon,
 					 void *buffer,
@@ -963,8 +1230,7 @@ ssize_t processx_c_connection_read_chars(processx_connection_t *ccon,
   processx__connection_find_chars(ccon, -1, nbyte, &utf8_chars, &utf8_bytes);
 
   memcpy(buffer, ccon->utf8, utf8_bytes);
-  ccon->utf8_data_size -= utf8_bytes;
-  memmove(ccon->utf8, ccon->utf8 + utf8_bytes, ccon->utf8_data_size);
+  processx__connection_consume_utf8(ccon, utf8_bytes);
 
   return utf8_bytes;
 }
@@ -1018,7 +1284,7 @@ ssize_t processx_c_connection_read_line(processx_connection_t *ccon,
 
   /* Newline will contain the end of the line now, even if EOF */
   if (newline == -1) newline = ccon->utf8_data_size;
-  if (ccon->utf8[newline - 1] == '\r') newline--;
+  if (newline > 0 && ccon->utf8[newline - 1] == '\r') newline--;
 
   if (! *linep) {
     *linep = malloc(newline + 1);
@@ -1034,21 +1300,15 @@ ssize_t processx_c_connection_read_line(processx_connection_t *ccon,
   (*linep)[newline] = '\0';
 
   if (!eof) {
-    ccon->utf8_data_size -= (newline + 1);
-    memmove(ccon->utf8, ccon->utf8 + newline + 1, ccon->utf8_data_size);
+    processx__connection_consume_utf8(ccon, newline + 1);
   } else {
-    ccon->utf8_data_size = 0;
+    processx__connection_consume_utf8(ccon, ccon->utf8_data_size);
   }
 
   return newline;
 }
 
-/* Write bytes */
-ssize_t processx_c_connection_write_bytes(
-  processx_connection_t *ccon,
-  const void *buffer,
-  size_t nbytes) {
-
+static void processx__connection_check_writable(processx_connection_t *ccon) {
   PROCESSX_CHECK_VALID_CONN(ccon);
 
   /* Do not allow writing to an un-accepted server socket */
@@ -1058,6 +1318,150 @@ ssize_t processx_c_connection_write_bytes(
     R_THROW_ERROR("Cannot write to an un-accepted socket connection");
   }
 
+  /* A queued write failed earlier, report it now */
+  if (ccon->write_error) {
+    int err = ccon->write_error;
+    ccon->write_error = 0;
+    R_THROW_SYSTEM_ERROR_CODE(err, "Cannot write connection");
+  }
+}
+
+static void processx__connection_drop_queue(processx_connection_t *ccon) {
+  free(ccon->wqueue);
+  ccon->wqueue = NULL;
+  ccon->wqueue_start = ccon->wqueue_size = ccon->wqueue_allocated = 0;
+}
+
+#ifndef _WIN32
+
+/* We need to ignore SIGPIPE while writing, otherwise R might crash.
+   Sockets do not need this if we can use MSG_NOSIGNAL. Returns 1 if
+   the disposition was changed, and needs to be restored. */
+
+static int processx__connection_ignore_sigpipe(processx_connection_t *ccon,
+					       struct sigaction *old_handler) {
+  struct sigaction new_handler;
+#ifdef MSG_NOSIGNAL
+  if (ccon->type == PROCESSX_FILE_TYPE_SOCKET) return 0;
+#endif
+  memset(&new_handler, 0, sizeof(new_handler));
+  sigemptyset(&new_handler.sa_mask);
+  new_handler.sa_handler = SIG_IGN;
+  sigaction(SIGPIPE, &new_handler, old_handler);
+  return 1;
+}
+
+static ssize_t processx__connection_write_os(processx_connection_t *ccon,
+					     const void *buffer,
+					     size_t nbytes) {
+  ssize_t ret;
+  do {
+#ifdef MSG_NOSIGNAL
+    if (ccon->type == PROCESSX_FILE_TYPE_SOCKET) {
+      ret = send(ccon->handle, buffer, nbytes, MSG_NOSIGNAL);
+    } else {
+      ret = write(ccon->handle, buffer, nbytes);
+    }
+#else
+    ret = write(ccon->handle, buffer, nbytes);
+#endif
+  } while (ret == -1 && errno == EINTR);
+  return ret;
+}
+
+/* Write as much as the OS takes now, without blocking. Returns the
+   number of bytes written, or -1 with errno set. */
+
+static ssize_t processx__connection_write_now(processx_connection_t *ccon,
+					      const void *buffer,
+					      size_t nbytes) {
+  struct sigaction old_handler;
+  int restore = processx__connection_ignore_sigpipe(ccon, &old_handler);
+  size_t written = 0;
+  int err = 0;
+
+  while (written < nbytes) {
+    ssize_t ret = processx__connection_write_os(
+      ccon, (const char*) buffer + written, nbytes - written);
+    if (ret == -1) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) err = errno;
+      break;
+    }
+    written += ret;
+  }
+
+  if (restore) sigaction(SIGPIPE, &old_handler, NULL);
+
+  if (err) {
+    errno = err;
+    return -1;
+  }
+  return (ssize_t) written;
+}
+
+#endif
+
+/* Write the queued bytes, as much as the OS takes now. Returns the number
+   of bytes that are still queued. If the write fails, the queue is
+   dropped, and the error is reported by the next write. */
+
+size_t processx_c_connection_flush(processx_connection_t *ccon) {
+  if (ccon->wqueue_size == 0) return 0;
+  if (ccon->is_closed_) {
+    processx__connection_drop_queue(ccon);
+    return 0;
+  }
+
+#ifdef _WIN32
+  /* Writes are synchronous, so this writes everything */
+  while (ccon->wqueue_size > 0) {
+    DWORD written;
+    BOOL ret = WriteFile(
+      /* hFile =                  */ ccon->handle.handle,
+      /* lpBuffer =               */ ccon->wqueue + ccon->wqueue_start,
+      /* nNumberOfBytesToWrite =  */ ccon->wqueue_size,
+      /* lpNumberOfBytesWritten = */ &written,
+      /* lpOverlapped =           */ NULL);
+    if (!ret) {
+      ccon->write_error = GetLastError();
+      break;
+    }
+    ccon->wqueue_start += written;
+    ccon->wqueue_size -= written;
+  }
+  processx__connection_drop_queue(ccon);
+  return 0;
+#else
+  ssize_t ret;
+
+  ret = processx__connection_write_now(
+    ccon, ccon->wqueue + ccon->wqueue_start, ccon->wqueue_size);
+  if (ret == -1) {
+    ccon->write_error = errno;
+    processx__connection_drop_queue(ccon);
+    return 0;
+  }
+
+  ccon->wqueue_start += ret;
+  ccon->wqueue_size -= ret;
+  /* Give back the memory, the queue might have been large */
+  if (ccon->wqueue_size == 0) processx__connection_drop_queue(ccon);
+  return ccon->wqueue_size;
+#endif
+}
+
+size_t processx_c_connection_write_pending(processx_connection_t *ccon) {
+  return ccon->wqueue_size;
+}
+
+/* Write bytes */
+ssize_t processx_c_connection_write_bytes(
+  processx_connection_t *ccon,
+  const void *buffer,
+  size_t nbytes) {
+
+  processx__connection_check_writable(ccon);
+
 #ifdef _WIN32
   DWORD written;
   BOOL ret = WriteFile(
@@ -1069,27 +1473,189 @@ ssize_t processx_c_connection_write_bytes(
   if (!ret) R_THROW_SYSTEM_ERROR("Cannot write connection");
   return (ssize_t) written;
 #else
-  /* Need to ignore SIGPIPE here, otherwise R might crash */
-  struct sigaction old_handler, new_handler;
-  memset(&new_handler, 0, sizeof(new_handler));
-  sigemptyset(&new_handler.sa_mask);
-  new_handler.sa_handler = SIG_IGN;
-  sigaction(SIGPIPE, &new_handler, &old_handler );
+  /* Queued bytes go first, to keep the order */
+  if (processx_c_connection_flush(ccon) > 0) return 0;
+  processx__connection_check_writable(ccon);
 
-  ssize_t ret = write(ccon->handle, buffer, nbytes);
-  int err = errno;
+  ssize_t ret = processx__connection_write_now(ccon, buffer, nbytes);
+  if (ret == -1) R_THROW_SYSTEM_ERROR("Cannot write connection");
+  return ret;
+#endif
+}
 
-  sigaction(SIGPIPE, &old_handler, NULL );
+/* Write all bytes: write what the OS takes now, and queue the rest. The
+   queue is flushed by `processx_c_connection_poll()`, when the
+   connection is writable, see `processx_c_pollable_from_connection_write()`.
+   Returns the number of queued bytes. */
 
-  if (ret == -1) {
-    if (err == EAGAIN || err == EWOULDBLOCK) {
-      return 0;
-    } else {
-      R_THROW_SYSTEM_ERROR("Cannot write connection");
+size_t processx_c_connection_write_queue(
+  processx_connection_t *ccon,
+  const void *buffer,
+  size_t nbytes) {
+
+#ifdef _WIN32
+  /* Writes are synchronous on Windows, they never leave anything behind */
+  size_t written = 0;
+  while (written < nbytes) {
+    written += processx_c_connection_write_bytes(
+      ccon, (const char*) buffer + written, nbytes - written);
+  }
+  return 0;
+#else
+  ssize_t written = processx_c_connection_write_bytes(ccon, buffer, nbytes);
+  size_t left = nbytes - written;
+  const char *rest = (const char*) buffer + written;
+
+  if (left > 0) processx_c_connection_queue(ccon, rest, left);
+  return ccon->wqueue_size;
+#endif
+}
+
+/* Add bytes to the write queue, without trying to write them. The next
+   flush will write them. */
+
+void processx_c_connection_queue(
+  processx_connection_t *ccon,
+  const void *buffer,
+  size_t nbytes) {
+
+  if (ccon->wqueue_start + ccon->wqueue_size + nbytes >
+      ccon->wqueue_allocated) {
+    if (ccon->wqueue_start > 0) {
+      memmove(ccon->wqueue, ccon->wqueue + ccon->wqueue_start,
+	      ccon->wqueue_size);
+      ccon->wqueue_start = 0;
+    }
+    if (ccon->wqueue_size + nbytes > ccon->wqueue_allocated) {
+      size_t newsize = ccon->wqueue_allocated * 2;
+      char *newqueue;
+      if (newsize < ccon->wqueue_size + nbytes) {
+	newsize = ccon->wqueue_size + nbytes;
+      }
+      newqueue = realloc(ccon->wqueue, newsize);
+      if (!newqueue) R_THROW_ERROR("Cannot queue write, out of memory");
+      ccon->wqueue = newqueue;
+      ccon->wqueue_allocated = newsize;
     }
   }
-  return ret;
+
+  memcpy(ccon->wqueue + ccon->wqueue_start + ccon->wqueue_size, buffer,
+	 nbytes);
+  ccon->wqueue_size += nbytes;
+}
+
+#define PROCESSX__RELAY_CHUNK (64 * 1024)
+/* At most this much per poll, so a fast source cannot keep us busy */
+#define PROCESSX__RELAY_MAX (1024 * 1024)
+
+/* Data that is already buffered in `from` is written first, then the
+   bytes go from fd to fd with `splice()` on Linux, if one of them is a
+   pipe. Otherwise they go through a small buffer. The bytes that `to`
+   does not take are queued, so nothing is lost, but then we stop. The
+   source is read in raw mode after this, like `conn_read_bytes()`. */
+
+size_t processx_c_connection_relay(
+  processx_connection_t *from,
+  processx_connection_t *to,
+  size_t nbytes,
+  int *blocked) {
+
+  size_t moved = 0;
+
+  *blocked = 0;
+  processx__connection_check_writable(to);
+#ifndef _WIN32
+  /* splice() and write() must not block on the target, SPLICE_F_NONBLOCK
+     only applies to the pipe side */
+  processx__nonblock_fcntl(to->handle, 1);
 #endif
+
+  /* Queued bytes go first */
+  if (processx_c_connection_flush(to) > 0) {
+    *blocked = 1;
+    return 0;
+  }
+
+  /* Already converted to UTF-8, but not read yet */
+  if (from->utf8_data_size > 0) {
+    size_t n = from->utf8_data_size < nbytes ? from->utf8_data_size : nbytes;
+    if (processx_c_connection_write_queue(to, from->utf8, n) > 0) {
+      *blocked = 1;
+    }
+    processx__connection_consume_utf8(from, n);
+    moved += n;
+    if (*blocked) return moved;
+  }
+
+  /* Read, but not converted yet, these must go before the rest */
+  if (from->buffer_data_size > 0 && moved < nbytes) {
+    size_t n = from->buffer_data_size < nbytes - moved ?
+      from->buffer_data_size : nbytes - moved;
+    from->raw_mode = 1;
+    if (processx_c_connection_write_queue(to, from->buffer, n) > 0) {
+      *blocked = 1;
+    }
+    processx__connection_consume_raw(from, n);
+    moved += n;
+    if (*blocked || moved == nbytes) return moved;
+  }
+
+#ifdef __linux__
+  if (!from->bgread && from->buffer_data_size == 0) {
+    struct sigaction old_handler;
+    int restore = processx__connection_ignore_sigpipe(to, &old_handler);
+    int err = 0, again = 0;
+    from->raw_mode = 1;
+    while (moved < nbytes && !from->is_eof_raw_) {
+      ssize_t ret = splice(from->handle, NULL, to->handle, NULL,
+			   nbytes - moved, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (ret > 0) {
+	moved += ret;
+      } else if (ret == 0) {
+	from->is_eof_raw_ = 1;
+	if (from->utf8_data_size == 0 && from->buffer_data_size == 0) {
+	  from->is_eof_ = 1;
+	}
+      } else if (errno == EINTR) {
+	continue;
+      } else if (errno == EAGAIN) {
+	/* Either side might be full, check the target */
+	struct pollfd pfd = { to->handle, POLLOUT, 0 };
+	if (poll(&pfd, 1, 0) == 0) *blocked = 1;
+	again = 1;
+	break;
+      } else if (errno == EINVAL || errno == ENOSYS) {
+	/* Not a pipe, or not supported for these files */
+	break;
+      } else {
+	err = errno;
+	break;
+      }
+    }
+    if (restore) sigaction(SIGPIPE, &old_handler, NULL);
+    if (err) {
+      R_THROW_SYSTEM_ERROR_CODE(err, "Cannot relay connection");
+    }
+    if (*blocked || again || from->is_eof_raw_ || moved == nbytes) {
+      return moved;
+    }
+  }
+#endif
+
+  while (moved < nbytes && !from->is_eof_) {
+    char chunk[PROCESSX__RELAY_CHUNK];
+    size_t todo = nbytes - moved < sizeof(chunk) ? nbytes - moved :
+      sizeof(chunk);
+    size_t n = processx__connection_read_raw(from, chunk, todo);
+    if (n == 0) break;
+    moved += n;
+    if (processx_c_connection_write_queue(to, chunk, n) > 0) {
+      *blocked = 1;
+      break;
+    }
+  }
+
+  return moved;
 }
 
 /* Check if the connection has ended */
@@ -1105,9 +1671,13 @@ void processx_c_connection_close(processx_connection_t *ccon) {
   }
   ccon->handle.handle = 0;
 #else
+  /* Stop the background reader before the fd can be reused */
+  processx__bgread_stop(ccon);
   if (ccon->handle >= 0) close(ccon->handle);
   ccon->handle = -1;
 #endif
+  /* Nobody can write the queued bytes any more */
+  processx__connection_drop_queue(ccon);
   ccon->is_closed_ = 1;
 }
 
@@ -1166,6 +1736,7 @@ int processx_c_connection_poll(processx_pollable_t pollables[],
     if (el->pre_poll_func) events[i] = el->pre_poll_func(el);
     switch (events[i]) {
     case PXHANDLE:
+    case PXWAIT:
       j++;
       break;
     default:
@@ -1173,7 +1744,7 @@ int processx_c_connection_poll(processx_pollable_t pollables[],
     }
   }
 
-  /* j contains the number of IOCP handles to poll */
+  /* j contains the number of IOCP handles and processes to poll */
 
   ptr = (int*) R_alloc(j, sizeof(int));
 
@@ -1198,6 +1769,7 @@ int processx_c_connection_poll(processx_pollable_t pollables[],
       break;
 
     case PXHANDLE:
+    case PXWAIT:
       el->event = PXSILENT;
       ptr[j] = i;
       j++;
@@ -1330,6 +1902,16 @@ int processx_c_connection_poll(processx_pollable_t pollables[],
       R_THROW_SYSTEM_ERROR_CODE(err, "Cannot poll");
     }
 
+    /* See if any of the processes have finished */
+
+    for (i = 0; i < npollables; i++) {
+      if (events[i] == PXWAIT && pollables[i].event == PXSILENT &&
+	  WaitForSingleObject(pollables[i].handle, 0) == WAIT_OBJECT_0) {
+	pollables[i].event = PXREADY;
+	hasdata++;
+      }
+    }
+
     if (hasdata) break;
     R_CheckUserInterrupt();
     timeleft -= PROCESSX_INTERRUPT_INTERVAL;
@@ -1353,9 +1935,12 @@ static int processx__poll_decode(short code) {
   return PXSILENT;
 }
 
-/* Poll connections and other pollable handles */
-int processx_c_connection_poll(processx_pollable_t pollables[],
-			       size_t npollables, int timeout) {
+/* One poll. `*flushed` is set to 1 if the poll only woke up to flush
+   write queues. */
+
+static int processx__connection_poll1(processx_pollable_t pollables[],
+				      size_t npollables, int timeout,
+				      int *flushed) {
 
   int hasdata = 0;
   size_t i, j = 0;
@@ -1364,6 +1949,7 @@ int processx_c_connection_poll(processx_pollable_t pollables[],
   int ret;
   int *events;
 
+  *flushed = 0;
   if (npollables == 0) return 0;
 
   /* Need to allocate this, because we need to put in the fds, maybe */
@@ -1377,6 +1963,7 @@ int processx_c_connection_poll(processx_pollable_t pollables[],
     if (el->pre_poll_func) events[i] = el->pre_poll_func(el);
     switch (events[i]) {
     case PXHANDLE:
+    case PXWAIT:
       j++;
       break;
     case PXSELECT: {
@@ -1411,9 +1998,10 @@ int processx_c_connection_poll(processx_pollable_t pollables[],
       break;
 
     case PXHANDLE:
+    case PXWAIT:
       el->event = PXSILENT;
       fds[j].fd = el->handle;
-      fds[j].events = POLLIN;
+      fds[j].events = el->write ? POLLOUT : POLLIN;
       fds[j].revents = 0;
       ptr[j] = (int) i;
       j++;
@@ -1455,7 +2043,40 @@ int processx_c_connection_poll(processx_pollable_t pollables[],
     }
 
   } else {
+    int others = 0;
     for (i = 0; i < j; i++) {
+      processx_pollable_t *el = pollables + ptr[i];
+      if (el->pre_poll_func == processx_i_pre_poll_func_connection &&
+	  el->object && ((processx_connection_t*) el->object)->relay) {
+	/* Relayed connection, move the data, this is not an event,
+	   unless we are at EOF */
+	if (fds[i].revents) {
+	  processx_connection_t *ccon = el->object;
+	  int blocked;
+	  processx_c_connection_relay(ccon, ccon->relay, PROCESSX__RELAY_MAX,
+				      &blocked);
+	  if (ccon->is_eof_) {
+	    el->event = PXREADY;
+	    hasdata++;
+	  }
+	  *flushed = 1;
+	}
+	continue;
+      }
+      if (pollables[ptr[i]].write) {
+	/* Errors are recorded by the flush, and reported by the next write.
+	   For PROCESSX_WRITE_DRAIN an empty queue ends the poll, so the
+	   caller can write more. */
+	if (fds[i].revents) {
+	  if (processx_c_connection_flush(pollables[ptr[i]].object) == 0 &&
+	      pollables[ptr[i]].write == PROCESSX_WRITE_DRAIN) {
+	    others = 1;
+	  }
+	  *flushed = 1;
+	}
+	continue;
+      }
+      if (fds[i].revents) others = 1;
       if (events[ptr[i]] == PXSELECT) {
         if (pollables[ptr[i]].event == PXSILENT) {
           int ev = fds[i].revents;
@@ -1475,11 +2096,43 @@ int processx_c_connection_poll(processx_pollable_t pollables[],
         }
       }
     }
+    if (others || hasdata) *flushed = 0;
   }
 
   return hasdata;
 }
 
+static double processx__connection_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+/* Poll connections and other pollable handles. Flushing write queues
+   does not count as an event, so if only that happened, we poll again,
+   until the timeout expires. Except if the write queue of a
+   PROCESSX_WRITE_DRAIN pollable is empty now, then we return, without
+   events. */
+
+int processx_c_connection_poll(processx_pollable_t pollables[],
+			       size_t npollables, int timeout) {
+
+  double deadline = timeout > 0 ? processx__connection_now() + timeout : 0;
+  int left = timeout;
+
+  for (;;) {
+    int flushed;
+    int hasdata = processx__connection_poll1(pollables, npollables, left,
+					     &flushed);
+    if (!flushed || left == 0) return hasdata;
+    if (timeout > 0) {
+      double remaining = deadline - processx__connection_now();
+      /* One last poll, to get the timeout events right */
+      left = remaining > 0 ? (int) remaining : 0;
+    }
+  }
+}
+
 #endif
 
 #ifdef _WIN32
@@ -1494,6 +2147,7 @@ void processx__connection_start_read(processx_connection_t *ccon) {
   if (ccon->handle.read_pending) return;
 
   if (!ccon->buffer) processx__connection_alloc(ccon);
+  processx__connection_compact_raw(ccon, 0);
 
   todo = ccon->buffer_allocated_size - ccon->buffer_data_size;
 
@@ -1575,10 +2229,46 @@ void processx__connection_start_read(processx_connection_t *ccon) {
     }									\
   } } while (0)
 
+/* A relayed connection is not ready for the caller, its data goes to
+   the relay target. We move what we can now, and then wait for more
+   data, or for the target to become writable. The poll moves the data
+   when the handle is ready, see `processx__connection_poll1()`.
+   Returns -1 if we need to poll the source as usual. */
+
+static int processx__connection_pre_poll_relay(processx_pollable_t *pollable) {
+  processx_connection_t *ccon = pollable->object;
+  int blocked;
+
+  if (ccon->relay->is_closed_) {
+    ccon->relay = NULL;
+    return -1;
+  }
+
+  processx_c_connection_relay(ccon, ccon->relay, PROCESSX__RELAY_MAX,
+			      &blocked);
+  if (ccon->is_eof_) return PXREADY;
+
+#ifndef _WIN32
+  if (blocked) {
+    pollable->write = 1;
+    pollable->handle = ccon->relay->handle;
+    return PXHANDLE;
+  }
+#endif
+
+  return -1;
+}
+
 int processx_i_pre_poll_func_connection(processx_pollable_t *pollable) {
 
   processx_connection_t *ccon = pollable->object;
 
+  pollable->write = 0;
+  if (ccon && !ccon->is_closed_ && ccon->relay) {
+    int ret = processx__connection_pre_poll_relay(pollable);
+    if (ret != -1) return ret;
+  }
+
   PROCESSX__I_PRE_POLL_FUNC_CONNECTION_READY;
 
 #ifdef _WIN32
@@ -1596,7 +2286,11 @@ int processx_i_pre_poll_func_connection(processx_pollable_t *pollable) {
     pollable->handle = ccon->handle.overlapped.hEvent;
   }
 #else
-  pollable->handle = ccon->handle;
+  if (ccon->bgread) {
+    pollable->handle = processx__bgread_fd(ccon);
+  } else {
+    pollable->handle = ccon->handle;
+  }
 #endif
 
   return PXHANDLE;
@@ -1609,10 +2303,35 @@ int processx_c_pollable_from_connection(
   pollable->pre_poll_func = processx_i_pre_poll_func_connection;
   pollable->object = ccon;
   pollable->free = 0;
+  pollable->write = 0;
   pollable->fds = R_NilValue;
   return 0;
 }
 
+static int processx_i_pre_poll_func_connection_write(
+  processx_pollable_t *pollable) {
+
+  processx_connection_t *ccon = pollable->object;
+  if (!ccon || ccon->is_closed_) return PXCLOSED;
+  if (ccon->wqueue_size == 0) return PXSILENT;
+#ifdef _WIN32
+  return PXSILENT;
+#else
+  pollable->handle = ccon->handle;
+  return PXHANDLE;
+#endif
+}
+
+int processx_c_pollable_from_connection_write(
+  processx_pollable_t *pollable,
+  processx_connection_t *ccon) {
+
+  processx_c_pollable_from_connection(pollable, ccon);
+  pollable->pre_poll_func = processx_i_pre_poll_func_connection_write;
+  pollable->write = 1;
+  return 0;
+}
+
 int processx_i_pre_poll_func_curl(processx_pollable_t *pollable) {
   return PXSELECT;
 }
@@ -1624,6 +2343,7 @@ int processx_c_pollable_from_curl(
   pollable->pre_poll_func = processx_i_pre_poll_func_curl;
   pollable->object = NULL;
   pollable->free = 0;
+  pollable->write = 0;
   pollable->fds = fds;
   return 0;
 }
@@ -1730,34 +2450,139 @@ static void processx__connection_xfinalizer(SEXP con) {
 static ssize_t processx__find_newline(processx_connection_t *ccon,
 				     size_t start) {
 
-  if (ccon->utf8_data_size == 0) return -1;
-  const char *ret = ccon->utf8 + start;
-  const char *end = ccon->utf8 + ccon->utf8_data_size;
+  const char *ret;
+
+  if (start >= ccon->utf8_data_size) return -1;
+  ret = memchr(ccon->utf8 + start, '\n', ccon->utf8_data_size - start);
+
+  if (ret) return ret - ccon->utf8; else return -1;
+}
+
+/* Remove bytes from the beginning of the UTF8 buffer. This also keeps
+   the newline scan position up to date. The rest of the data is not
+   moved, see processx__connection_compact_utf8(). */
+static void processx__connection_consume_utf8(processx_connection_t *ccon,
+					      size_t nbytes) {
+  ccon->utf8 += nbytes;
+  ccon->utf8_allocated_size -= nbytes;
+  ccon->utf8_data_size -= nbytes;
+  ccon->utf8_scanned =
+    ccon->utf8_scanned > nbytes ? ccon->utf8_scanned - nbytes : 0;
+  if (ccon->utf8_data_size == 0) {
+    processx__connection_compact_utf8(ccon, 1);
+    processx__connection_drained(ccon);
+  }
+}
 
-  while (ret < end && *ret != '\n') ret++;
+/* Same for the raw buffer */
+static void processx__connection_consume_raw(processx_connection_t *ccon,
+					     size_t nbytes) {
+  ccon->buffer += nbytes;
+  ccon->buffer_allocated_size -= nbytes;
+  ccon->buffer_data_size -= nbytes;
+  if (ccon->buffer_data_size == 0) {
+    processx__connection_compact_raw(ccon, 1);
+    processx__connection_drained(ccon);
+  }
+}
 
-  if (ret < end) return ret - ccon->utf8; else return -1;
+/* Move the data back to the start of the buffer, to make room for more.
+   Unless `force` is set, we only do this if we need room, and we have
+   consumed at least as much as we need to move, so the copying is
+   linear in the size of the consumed data. */
+/* Grow the raw buffer, and copy the unread bytes to its beginning.
+   Returns 0 if it is already at the maximum size, or out of memory. */
+
+static int processx__connection_grow_raw(processx_connection_t *ccon) {
+  size_t offset = ccon->buffer - ccon->buffer_base;
+  size_t old_size = offset + ccon->buffer_allocated_size;
+  size_t new_size, max = ccon->buffer_policy.max;
+  char *nb;
+  int pooled;
+
+  new_size = (size_t) (old_size * ccon->buffer_policy.growth);
+  if (new_size <= old_size) new_size = 2 * old_size;
+  if (max > 0 && new_size > max) new_size = max;
+  if (new_size <= old_size) return 0;
+
+  nb = processx__pool_alloc(new_size, &pooled);
+  if (!nb) return 0;
+  if (ccon->buffer_data_size > 0) {
+    memcpy(nb, ccon->buffer, ccon->buffer_data_size);
+  }
+  processx__pool_free(ccon->buffer_base, ccon->buffer_pooled);
+  ccon->buffer = ccon->buffer_base = nb;
+  ccon->buffer_pooled = pooled;
+  ccon->buffer_allocated_size = new_size;
+  return 1;
+}
+
+/* Moving the unread bytes to the beginning costs O(unread), so unless
+   `force` is set, we only do it if at least as many bytes were consumed,
+   or the buffer is full and at least half of it was consumed. If it is
+   full, and less was consumed, then we grow it instead, up to the
+   maximum size, otherwise a busy connection would move the whole buffer
+   for every small read. */
+
+static void processx__connection_compact_raw(processx_connection_t *ccon,
+					     int force) {
+  size_t offset = ccon->buffer - ccon->buffer_base;
+  size_t free = ccon->buffer_allocated_size - ccon->buffer_data_size;
+  if (offset == 0) return;
+#ifdef _WIN32
+  /* The background thread is reading into the buffer */
+  if (ccon->handle.read_pending) return;
+#endif
+  if (!force && offset < ccon->buffer_data_size) {
+    if (free > 0) return;
+    if (offset < (offset + ccon->buffer_allocated_size) / 2) {
+      processx__connection_grow_raw(ccon);
+      return;
+    }
+  }
+  if (ccon->buffer_data_size > 0) {
+    memmove(ccon->buffer_base, ccon->buffer, ccon->buffer_data_size);
+  }
+  ccon->buffer = ccon->buffer_base;
+  ccon->buffer_allocated_size += offset;
+}
+
+static void processx__connection_compact_utf8(processx_connection_t *ccon,
+					      int force) {
+  size_t offset = ccon->utf8 - ccon->utf8_base;
+  size_t free = ccon->utf8_allocated_size - ccon->utf8_data_size;
+  if (offset == 0) return;
+  if (!force && free > 8 && offset < ccon->utf8_data_size) return;
+  if (ccon->utf8_data_size > 0) {
+    memmove(ccon->utf8_base, ccon->utf8, ccon->utf8_data_size);
+  }
+  ccon->utf8 = ccon->utf8_base;
+  ccon->utf8_allocated_size += offset;
 }
 
 static ssize_t processx__connection_read_until_newline
   (processx_connection_t *ccon) {
 
-  char *ptr, *end;
+  ssize_t newline;
 
   /* Make sure we try to have something, unless EOF */
   if (ccon->utf8_data_size == 0) processx__connection_read(ccon);
   if (ccon->utf8_data_size == 0) return -1;
 
-  /* We have sg in the utf8 at this point */
+  /* We have sg in the utf8 at this point. We don't need to look at the
+     bytes that we have already scanned in a previous call, so a long
+     line that arrives in many pieces is only scanned once. */
 
-  ptr = ccon->utf8;
-  end = ccon->utf8 + ccon->utf8_data_size;
   while (1) {
     ssize_t new_bytes;
-    while (ptr < end && *ptr != '\n') ptr++;
+    newline = processx__find_newline(ccon, ccon->utf8_scanned);
 
     /* Have we found a newline? */
-    if (ptr < end) return ptr - ccon->utf8;
+    if (newline != -1) {
+      ccon->utf8_scanned = newline;
+      return newline;
+    }
+    ccon->utf8_scanned = ccon->utf8_data_size;
 
     /* No newline, but EOF? */
     if (ccon->is_eof_) return -1;
@@ -1767,11 +2592,7 @@ static ssize_t processx__connection_read_until_newline
      * character, and this makes sure that we don't stop just because
      * no more UTF8 characters fit in the UTF8 buffer. */
     if (ccon->utf8_data_size >= ccon->utf8_allocated_size - 8) {
-      size_t ptrnum = ptr - ccon->utf8;
-      size_t endnum = end - ccon->utf8;
       processx__connection_realloc(ccon);
-      ptr = ccon->utf8 + ptrnum;
-      end = ccon->utf8 + endnum;
     }
     new_bytes = processx__connection_read(ccon);
 
@@ -1783,33 +2604,132 @@ static ssize_t processx__connection_read_until_newline
 /* Allocate buffer for reading */
 
 static void processx__connection_alloc(processx_connection_t *ccon) {
-  ccon->buffer = malloc(64 * 1024);
+  size_t size = ccon->buffer_policy.initial;
+
+  ccon->buffer = processx__pool_alloc(size, &ccon->buffer_pooled);
   if (!ccon->buffer) R_THROW_ERROR("Cannot allocate memory for processx buffer");
-  ccon->buffer_allocated_size = 64 * 1024;
+  ccon->buffer_base = ccon->buffer;
+  ccon->buffer_allocated_size = size;
   ccon->buffer_data_size = 0;
 
-  ccon->utf8 = malloc(64 * 1024);
+  ccon->utf8 = processx__pool_alloc(size, &ccon->utf8_pooled);
   if (!ccon->utf8) {
-    free(ccon->buffer);
+    processx__pool_free(ccon->buffer, ccon->buffer_pooled);
+    ccon->buffer = ccon->buffer_base = 0;
     R_THROW_ERROR("Cannot allocate memory for processx buffer");
   }
-  ccon->utf8_allocated_size = 64 * 1024;
+  ccon->utf8_base = ccon->utf8;
+  ccon->utf8_allocated_size = size;
   ccon->utf8_data_size = 0;
+  ccon->utf8_scanned = 0;
+}
+
+/* Resize a buffer, keeping the first `data_size` bytes. Pool pages
+   cannot be realloc()-d, so these are copied. Returns NULL if out of
+   memory, and then the old buffer is kept. */
+
+static char *processx__connection_resize(char *ptr, int *pooled,
+					 size_t data_size, size_t new_size) {
+  char *nb;
+  int newpooled;
+  if (!*pooled && new_size != PROCESSX_BUFFER_INITIAL) {
+    return realloc(ptr, new_size);
+  }
+  nb = processx__pool_alloc(new_size, &newpooled);
+  if (!nb) return NULL;
+  if (data_size > 0) memcpy(nb, ptr, data_size);
+  processx__pool_free(ptr, *pooled);
+  *pooled = newpooled;
+  return nb;
 }
 
 /* We only really need to re-alloc the UTF8 buffer, because the
    other buffer is transient, even if there are no newline characters. */
 
 static void processx__connection_realloc(processx_connection_t *ccon) {
-  size_t new_size = (size_t) (ccon->utf8_allocated_size * 1.2);
+  size_t old_size, new_size, max = ccon->buffer_policy.max;
   void *nb;
-  if (new_size == ccon->utf8_allocated_size) new_size = 2 * new_size;
-  nb = realloc(ccon->utf8, new_size);
+
+  /* Maybe we have room at the beginning */
+  processx__connection_compact_utf8(ccon, 1);
+  if (ccon->utf8_data_size < ccon->utf8_allocated_size - 8) return;
+
+  old_size = ccon->utf8_allocated_size;
+  new_size = (size_t) (old_size * ccon->buffer_policy.growth);
+  if (new_size <= old_size) new_size = 2 * old_size;
+  if (max > 0 && new_size > max) new_size = max;
+  if (new_size <= old_size) {
+    R_THROW_ERROR("Line is longer than the maximum buffer size, %.0f bytes",
+		  (double) max);
+  }
+  nb = processx__connection_resize(ccon->utf8_base, &ccon->utf8_pooled,
+				   ccon->utf8_data_size, new_size);
   if (!nb) R_THROW_ERROR("Cannot allocate memory for processx line");
-  ccon->utf8 = nb;
+  ccon->utf8 = ccon->utf8_base = nb;
   ccon->utf8_allocated_size = new_size;
 }
 
+/* Shrink the drained buffers back to their initial size, so a connection
+   that had a burst of output does not hold on to a lot of memory. */
+
+static void processx__connection_shrink(processx_connection_t *ccon) {
+  size_t size = ccon->buffer_policy.initial;
+  void *nb;
+
+  if (ccon->utf8 && ccon->utf8_data_size == 0 &&
+      ccon->utf8 == ccon->utf8_base &&
+      ccon->utf8_allocated_size > size) {
+    nb = processx__connection_resize(ccon->utf8_base, &ccon->utf8_pooled, 0,
+				     size);
+    if (nb) {
+      ccon->utf8 = ccon->utf8_base = nb;
+      ccon->utf8_allocated_size = size;
+    }
+  }
+
+#ifdef _WIN32
+  /* The background thread is reading into the buffer */
+  if (ccon->handle.read_pending) return;
+#endif
+
+  if (ccon->buffer && ccon->buffer_data_size == 0 &&
+      ccon->buffer == ccon->buffer_base &&
+      ccon->buffer_allocated_size > size) {
+    nb = processx__connection_resize(ccon->buffer_base, &ccon->buffer_pooled,
+				     0, size);
+    if (nb) {
+      ccon->buffer = ccon->buffer_base = nb;
+      ccon->buffer_allocated_size = size;
+    }
+  }
+}
+
+/* Called when a buffer was drained. Shrink the buffers if requested, and
+   give pool pages back to the pool if there is no data in them. They are
+   allocated again, when new data arrives. At EOF we keep them, because no
+   new data will come, and some code expects the buffers after a read. */
+
+static void processx__connection_drained(processx_connection_t *ccon) {
+  if (ccon->buffer_policy.shrink) processx__connection_shrink(ccon);
+
+  if (!ccon->buffer || !ccon->utf8) return;
+  if (!ccon->buffer_pooled || !ccon->utf8_pooled) return;
+  if (ccon->buffer_data_size > 0 || ccon->utf8_data_size > 0) return;
+  if (ccon->is_eof_raw_) return;
+#ifdef _WIN32
+  /* The background thread is reading into the buffer */
+  if (ccon->handle.read_pending) return;
+#endif
+
+  processx__pool_free(ccon->buffer_base, 1);
+  processx__pool_free(ccon->utf8_base, 1);
+  ccon->buffer = ccon->utf8 = 0;
+  ccon->buffer_base = ccon->utf8_base = 0;
+  ccon->buffer_pooled = ccon->utf8_pooled = 0;
+  ccon->buffer_allocated_size = ccon->utf8_allocated_size = 0;
+  ccon->utf8_scanned = 0;
+}
+
 /* Read as much as we can. This is the only function that explicitly
    works with the raw buffer. It is also the only function that actually
    reads from the data source.
@@ -1836,6 +2756,7 @@ ssize_t processx__connection_read(processx_connection_t *ccon) {
   }
 
   if (!ccon->buffer) processx__connection_alloc(ccon);
+  processx__connection_compact_raw(ccon, 0);
 
   /* If cannot read anything more, then try to convert to UTF8 */
   todo = ccon->buffer_allocated_size - ccon->buffer_data_size;
@@ -1895,25 +2816,26 @@ ssize_t processx__connection_read(processx_connection_t *ccon) {
   return bytes_read;
 }
 
-#else
+/* Reads are asynchronous, so we don't know how much data is available */
 
-static ssize_t processx__connection_read(processx_connection_t *ccon) {
-  ssize_t todo, bytes_read;
+static size_t processx__connection_available(processx_connection_t *ccon) {
+  return 0;
+}
 
-  /* Nothing to read, nothing to convert to UTF8 */
-  if (ccon->is_eof_raw_ && ccon->buffer_data_size == 0) {
-    if (ccon->utf8_data_size == 0) ccon->is_eof_ = 1;
-    return 0;
-  }
+#else
 
-  if (!ccon->buffer) processx__connection_alloc(ccon);
+/* Read from the OS into `buf`. Returns the number of bytes read, or
+   zero if there is nothing to read now, or at EOF. */
 
-  /* If cannot read anything more, then try to convert to UTF8 */
-  todo = ccon->buffer_allocated_size - ccon->buffer_data_size;
-  if (todo == 0) return processx__connection_to_utf8(ccon);
+static ssize_t processx__connection_read_os(processx_connection_t *ccon,
+					    void *buf, size_t todo) {
+  ssize_t bytes_read;
 
-  /* Otherwise we read */
-  bytes_read = read(ccon->handle, ccon->buffer + ccon->buffer_data_size, todo);
+  if (ccon->bgread) {
+    bytes_read = processx__bgread_read(ccon, buf, todo);
+  } else {
+    bytes_read = read(ccon->handle, buf, todo);
+  }
 
   if (bytes_read == 0) {
     /* EOF */
@@ -1940,6 +2862,38 @@ static ssize_t processx__connection_read(processx_connection_t *ccon) {
     R_THROW_SYSTEM_ERROR("Cannot read from processx connection");
   }
 
+  return bytes_read;
+}
+
+/* How many bytes can we read without blocking? Zero if we don't know. */
+
+static size_t processx__connection_available(processx_connection_t *ccon) {
+  int avail = 0;
+  if (ccon->bgread) return 0;
+  if (ioctl(ccon->handle, FIONREAD, &avail) == -1 || avail < 0) return 0;
+  return avail;
+}
+
+static ssize_t processx__connection_read(processx_connection_t *ccon) {
+  ssize_t todo, bytes_read;
+
+  /* Nothing to read, nothing to convert to UTF8 */
+  if (ccon->is_eof_raw_ && ccon->buffer_data_size == 0) {
+    if (ccon->utf8_data_size == 0) ccon->is_eof_ = 1;
+    return 0;
+  }
+
+  if (!ccon->buffer) processx__connection_alloc(ccon);
+  processx__connection_compact_raw(ccon, 0);
+
+  /* If cannot read anything more, then try to convert to UTF8 */
+  todo = ccon->buffer_allocated_size - ccon->buffer_data_size;
+  if (todo == 0) return processx__connection_to_utf8(ccon);
+
+  /* Otherwise we read */
+  bytes_read = processx__connection_read_os(
+    ccon, ccon->buffer + ccon->buffer_data_size, todo);
+
   ccon->buffer_data_size += bytes_read;
 
   /* If there is anything to convert to UTF8, try converting.
@@ -1954,17 +2908,213 @@ static ssize_t processx__connection_read(processx_connection_t *ccon) {
 }
 #endif
 
+/* Read raw bytes into `buf`. Buffered data comes first, but if there is
+ * none, then on Unix we read from the OS directly into `buf`, to avoid
+ * copying. On Windows the reads are asynchronous, into the connection
+ * buffer, so we need to copy. */
+
+static size_t processx__connection_read_raw(processx_connection_t *ccon,
+					    void *buf, size_t nbytes) {
+  size_t to_read;
+
+  ccon->raw_mode = 1;
+
+#ifndef _WIN32
+  if (ccon->buffer_data_size == 0 && !ccon->is_eof_raw_ && nbytes > 0) {
+    ssize_t got = processx__connection_read_os(ccon, buf, nbytes);
+    if (ccon->is_eof_raw_) ccon->is_eof_ = 1;
+    return got;
+  }
+#endif
+
+  if (ccon->buffer_data_size == 0 && !ccon->is_eof_raw_) {
+    processx__connection_read(ccon);
+  }
+  if (ccon->is_eof_raw_ && ccon->buffer_data_size == 0) {
+    ccon->is_eof_ = 1;
+  }
+
+  to_read = ccon->buffer_data_size;
+  if (nbytes < to_read) to_read = nbytes;
+  if (to_read > 0) {
+    memcpy(buf, ccon->buffer, to_read);
+    processx__connection_consume_raw(ccon, to_read);
+  }
+
+  return to_read;
+}
+
+/* Is the encoding UTF-8? An empty string means the native encoding. */
+
+static int processx__encoding_is_utf8(const char *encoding) {
+  if (!encoding || !encoding[0]) {
+#ifdef _WIN32
+    return GetACP() == CP_UTF8;
+#else
+    encoding = nl_langinfo(CODESET);
+    if (!encoding) return 0;
+#endif
+  }
+  return !strcasecmp(encoding, "UTF-8") || !strcasecmp(encoding, "UTF8");
+}
+
+/* Length of the longest prefix of `s` that is valid UTF-8, and only has
+ * complete characters. ASCII is checked eight bytes at a time. */
+
+static size_t processx__utf8_valid(const unsigned char *s, size_t n) {
+  size_t i = 0;
+  while (i < n) {
+    unsigned char c = s[i];
+    if (c < 0x80) {
+      uint64_t w;
+      i++;
+      while (i + 8 <= n) {
+	memcpy(&w, s + i, 8);
+	if (w & UINT64_C(0x8080808080808080)) break;
+	i += 8;
+      }
+
+    } else if (c >= 0xc2 && c <= 0xdf) {
+      if (i + 1 >= n || (s[i + 1] & 0xc0) != 0x80) return i;
+      i += 2;
+
+    } else if (c >= 0xe0 && c <= 0xef) {
+      unsigned char lo = c == 0xe0 ? 0xa0 : 0x80;
+      unsigned char hi = c == 0xed ? 0x9f : 0xbf;
+      if (i + 2 >= n || s[i + 1] < lo || s[i + 1] > hi ||
+	  (s[i + 2] & 0xc0) != 0x80) {
+	return i;
+      }
+      i += 3;
+
+    } else if (c >= 0xf0 && c <= 0xf4) {
+      unsigned char lo = c == 0xf0 ? 0x90 : 0x80;
+      unsigned char hi = c == 0xf4 ? 0x8f : 0xbf;
+      if (i + 3 >= n || s[i + 1] < lo || s[i + 1] > hi ||
+	  (s[i + 2] & 0xc0) != 0x80 || (s[i + 3] & 0xc0) != 0x80) {
+	return i;
+      }
+      i += 4;
+
+    } else {
+      return i;
+    }
+  }
+  return i;
+}
+
+/* Is `s` the beginning of a valid, but incomplete UTF-8 character? */
+
+static int processx__utf8_incomplete(const unsigned char *s, size_t n) {
+  size_t need, i;
+  if (s[0] >= 0xc2 && s[0] <= 0xdf) {
+    need = 2;
+  } else if (s[0] >= 0xe0 && s[0] <= 0xef) {
+    need = 3;
+  } else if (s[0] >= 0xf0 && s[0] <= 0xf4) {
+    need = 4;
+  } else {
+    return 0;
+  }
+  if (n >= need) return 0;
+  for (i = 1; i < n; i++) if ((s[i] & 0xc0) != 0x80) return 0;
+  return 1;
+}
+
+/* The input is UTF-8 already, so instead of iconv we only validate it,
+ * and drop the invalid bytes, like iconv does in
+ * processx__connection_to_utf8(). If there is no UTF-8 data yet, and
+ * the whole buffer is valid, then we just swap the two buffers. */
+
+static ssize_t processx__connection_to_utf8_passthrough(
+  processx_connection_t *ccon) {
+
+  const unsigned char *in = (const unsigned char*) ccon->buffer;
+  size_t inbytes = ccon->buffer_data_size;
+  size_t outbytes = ccon->utf8_allocated_size - ccon->utf8_data_size;
+  char *out = ccon->utf8 + ccon->utf8_data_size;
+  size_t i = 0, outdone = 0;
+#ifdef _WIN32
+  /* A pending read writes into the buffer, so we cannot swap it */
+  int can_swap = !ccon->handle.read_pending;
+#else
+  int can_swap = 1;
+#endif
+
+  if (inbytes == 0 || outbytes == 0) return 0;
+
+  if (can_swap && ccon->utf8_data_size == 0 &&
+      processx__utf8_valid(in, inbytes) == inbytes) {
+    char *tmp = ccon->utf8, *tmpbase = ccon->utf8_base;
+    size_t tmpsize = ccon->utf8_allocated_size;
+    int tmppooled = ccon->utf8_pooled;
+    ccon->utf8 = ccon->buffer;
+    ccon->utf8_base = ccon->buffer_base;
+    ccon->utf8_allocated_size = ccon->buffer_allocated_size;
+    ccon->utf8_pooled = ccon->buffer_pooled;
+    ccon->utf8_data_size = inbytes;
+    ccon->buffer = tmp;
+    ccon->buffer_base = tmpbase;
+    ccon->buffer_allocated_size = tmpsize;
+    ccon->buffer_pooled = tmppooled;
+    ccon->buffer_data_size = 0;
+    processx__connection_compact_raw(ccon, 1);
+    return inbytes;
+  }
+
+  while (i < inbytes) {
+    size_t len = processx__utf8_valid(in + i, inbytes - i);
+    int full = 0;
+    if (len > outbytes - outdone) {
+      /* Only copy complete characters */
+      len = outbytes - outdone;
+      while (len > 0 && (in[i + len] & 0xc0) == 0x80) len--;
+      full = 1;
+    }
+    memcpy(out + outdone, in + i, len);
+    outdone += len;
+    i += len;
+    if (full || i == inbytes) break;
+
+    if (processx__utf8_incomplete(in + i, inbytes - i)) {
+      /* This is fine, we'll handle it later, unless we are at the end */
+      if (ccon->is_eof_raw_) {
+	warning("Invalid multi-byte character at end of stream ignored");
+	i = inbytes;
+      }
+      break;
+    }
+
+    /* Invalid byte, skip it */
+    i++;
+  }
+
+  ccon->utf8_data_size += outdone;
+  if (i > 0) processx__connection_consume_raw(ccon, i);
+
+  return outdone;
+}
+
 static ssize_t processx__connection_to_utf8(processx_connection_t *ccon) {
 
   const char *inbuf, *inbufold;
   char *outbuf, *outbufold;
   size_t inbytesleft = ccon->buffer_data_size;
-  size_t outbytesleft = ccon->utf8_allocated_size - ccon->utf8_data_size;
+  size_t outbytesleft;
   size_t r, indone = 0, outdone = 0;
   int moved = 0;
   const char *emptystr = "";
   const char *encoding = ccon->encoding ? ccon->encoding : emptystr;
 
+  /* Make room for the output, if needed */
+  processx__connection_compact_utf8(ccon, 0);
+
+  if (ccon->utf8_passthrough) {
+    return processx__connection_to_utf8_passthrough(ccon);
+  }
+
+  outbytesleft = ccon->utf8_allocated_size - ccon->utf8_data_size;
+
   inbuf = inbufold = ccon->buffer;
   outbuf = outbufold = ccon->utf8 + ccon->utf8_data_size;
 
@@ -2006,11 +3156,8 @@ static ssize_t processx__connection_to_utf8(processx_connection_t *ccon) {
   /* We converted 'r' bytes, update the buffer structure accordingly */
   indone = inbuf - inbufold;
   outdone = outbuf - outbufold;
-  if (outdone > 0 || indone > 0) {
-    ccon->buffer_data_size -= indone;
-    memmove(ccon->buffer, ccon->buffer + indone, ccon->buffer_data_size);
-    ccon->utf8_data_size += outdone;
-  }
+  ccon->utf8_data_size += outdone;
+  if (indone > 0) processx__connection_consume_raw(ccon, indone);
 
   return outdone;
 }
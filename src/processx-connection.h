@@ -62,6 +62,18 @@ typedef enum {
   PROCESSX_SOCKET_CONNECTED_CLIENT
 } processx_socket_state_t;
 
+/* Buffer sizing of a connection, see `default_buffer_options()` in R */
+
+typedef struct processx_buffer_policy_s {
+  size_t initial;		/* initial size of the buffers */
+  size_t max;			/* max size of the UTF8 buffer, 0 is no limit */
+  double growth;		/* growth factor of the UTF8 buffer */
+  int shrink;			/* shrink drained buffers to `initial`? */
+} processx_buffer_policy_t;
+
+#define PROCESSX_BUFFER_INITIAL (64 * 1024)
+#define PROCESSX_BUFFER_GROWTH 2.0
+
 typedef struct processx_connection_s {
   processx_file_type_t type;
 
@@ -73,20 +85,48 @@ typedef struct processx_connection_s {
   char *encoding;
   void *iconv_ctx;
   int raw_mode;			/* If 1, skip UTF-8 conversion; data stays in buffer */
+  int utf8_passthrough;		/* If 1, input is UTF-8, only validate it */
 
   processx_i_connection_t handle;
 
+  /* `buffer` and `utf8` point to the first byte of the data, and the
+     `_allocated_size` fields are the space from there. Consuming data
+     moves the pointer forward, the data is only moved back to `_base`,
+     the start of the allocation, when we need room for more. */
   char* buffer;
+  char *buffer_base;
   size_t buffer_allocated_size;
   size_t buffer_data_size;
+  int buffer_pooled;		/* from the buffer pool? see bufpool.c */
 
   char *utf8;
+  char *utf8_base;
+  int utf8_pooled;
   size_t utf8_allocated_size;
   size_t utf8_data_size;
+  size_t utf8_scanned;		/* no newline in utf8 before this */
+
+  processx_buffer_policy_t buffer_policy;
+
+  /* Bytes that were queued for writing, but the OS did not take yet,
+     see `processx_c_connection_write_queue()`. They are written when
+     a poll reports that the connection is writable. */
+  char *wqueue;
+  size_t wqueue_start;
+  size_t wqueue_size;
+  size_t wqueue_allocated;
+  int write_error;		/* errno of a failed queued write, or 0 */
+
+  /* Data read from this connection goes to `relay` when polled, see
+     `processx_c_connection_relay()` */
+  struct processx_connection_s *relay;
 
   int poll_idx;
   char *filename;
   int state;
+#ifndef _WIN32
+  void *bgread;			/* background reader, see unix/bgread.c */
+#endif
 } processx_connection_t;
 
 struct processx_pollable_s;
@@ -123,13 +163,21 @@ typedef int (*processx_connection_pre_poll_func_t)(
  *   `PXSILENT` (no data), `PXREADY` (data), `PXTIMEOUT` (timeout).
  * @member fd If the pollable is an fd, then it is stored here instead of
  *   in `object`, for simplicity.
+ * @member write Whether to poll the handle for writing instead of
+ *   reading. These pollables flush the write queue of a connection,
+ *   their `event` is always `PXSILENT` or `PXTIMEOUT`. If it is
+ *   `PROCESSX_WRITE_DRAIN`, then the poll also returns when the write
+ *   queue becomes empty, so the caller can queue more data.
  */
 
+#define PROCESSX_WRITE_DRAIN 2
+
 typedef struct processx_pollable_s {
   processx_connection_pre_poll_func_t pre_poll_func;
   void *object;
   int free;
   int event;
+  int write;
   processx_file_handle_t handle;
   SEXP fds;
 } processx_pollable_t;
@@ -166,9 +214,21 @@ SEXP processx_connection_read_bytes(SEXP con, SEXP nbytes);
 /* Read lines of characters from the connection. */
 SEXP processx_connection_read_lines(SEXP con, SEXP nlines);
 
+/* Read everything until EOF, waiting for data if needed. `what` is
+   0 for a string, 1 for a character vector of lines, 2 for raw bytes. */
+SEXP processx_connection_read_all(SEXP con, SEXP what);
+
 /* Write characters */
 SEXP processx_connection_write_bytes(SEXP con, SEXP chars);
 
+/* Write all bytes, queue the ones that cannot be written now */
+SEXP processx_connection_write_queue(SEXP con, SEXP bytes);
+SEXP processx_connection_write_pending(SEXP con);
+
+/* Move data between connections */
+SEXP processx_connection_relay(SEXP from, SEXP to, SEXP nbytes);
+SEXP processx_connection_set_relay(SEXP from, SEXP to);
+
 /* Check if the connection has ended. */
 SEXP processx_connection_is_eof(SEXP con);
 
@@ -192,6 +252,11 @@ SEXP processx_connection_set_stderr(SEXP con, SEXP drop);
 
 SEXP processx_connection_get_fileno(SEXP con);
 
+/* Start reading the connection in a background thread */
+SEXP processx_connection_background_read(SEXP con);
+SEXP processx_connection_set_buffer_policy(SEXP con, SEXP initial, SEXP max,
+					   SEXP growth, SEXP shrink);
+
 SEXP processx_connection_disable_inheritance(void);
 
 SEXP processx_is_valid_fd(SEXP fd);
@@ -208,6 +273,12 @@ processx_connection_t *processx_c_connection_create(
   const char *filename,
   SEXP *r_connection);
 
+/* Set the buffer sizing of a connection. It only affects buffers that
+   are allocated later. */
+void processx_c_connection_set_buffer_policy(
+  processx_connection_t *ccon,
+  const processx_buffer_policy_t *policy);
+
 /* Destroy connection object. We need this for the C API */
 void processx_c_connection_destroy(processx_connection_t *ccon);
 
@@ -217,6 +288,12 @@ ssize_t processx_c_connection_read_chars(
   void *buffer,
   size_t nbyte);
 
+/* Read raw bytes. Switches the connection to raw mode. */
+ssize_t processx_c_connection_read_bytes(
+  processx_connection_t *con,
+  void *buffer,
+  size_t nbytes);
+
 /* Read lines of characters */
 ssize_t processx_c_connection_read_line(
   processx_connection_t *ccon,
@@ -229,6 +306,36 @@ ssize_t processx_c_connection_write_bytes(
   const void *buffer,
   size_t nbytes);
 
+/* Write all bytes, queue what cannot be written now. Returns the
+   number of queued bytes. */
+size_t processx_c_connection_write_queue(
+  processx_connection_t *con,
+  const void *buffer,
+  size_t nbytes);
+
+/* Add bytes to the write queue, without writing them */
+void processx_c_connection_queue(
+  processx_connection_t *con,
+  const void *buffer,
+  size_t nbytes);
+
+/* Move at most `nbytes` bytes from `from` to `to`, without reading them
+   into R. Returns the number of bytes moved. `*blocked` is set to 1 if
+   `to` cannot take more now. */
+size_t processx_c_connection_relay(
+  processx_connection_t *from,
+  processx_connection_t *to,
+  size_t nbytes,
+  int *blocked);
+
+/* Write queued bytes, returns the number of bytes still queued */
+size_t processx_c_connection_flush(
+  processx_connection_t *con);
+
+/* Number of queued bytes, without writing */
+size_t processx_c_connection_write_pending(
+  processx_connection_t *con);
+
 /* Check if the connection has ended */
 int processx_c_connection_is_eof(
   processx_connection_t *con);
@@ -249,6 +356,11 @@ int processx_c_pollable_from_connection(
   processx_pollable_t *pollable,
   processx_connection_t *ccon);
 
+/* A pollable that flushes the write queue of the connection */
+int processx_c_pollable_from_connection_write(
+  processx_pollable_t *pollable,
+  processx_connection_t *ccon);
+
 int processx_c_pollable_from_curl(
   processx_pollable_t *pollable, SEXP fds);
 
@@ -267,6 +379,7 @@ typedef unsigned long DWORD;
 
 #ifdef _WIN32
 int processx__start_thread(void);
+HANDLE processx__get_default_iocp(void);
 extern HANDLE processx__iocp_thread;
 extern HANDLE processx__thread_start;
 extern HANDLE processx__thread_done;
@@ -46,8 +46,37 @@ SEXP processx_exec(SEXP command, SEXP args, SEXP pty, SEXP pty_options,
 		   SEXP connections, SEXP env, SEXP windows_verbatim_args,
 		   SEXP windows_hide_window, SEXP windows_detached_process,
 		   SEXP private_, SEXP cleanup, SEXP cleanup_grace,
-		   SEXP wd, SEXP encoding, SEXP tree_id, SEXP linux_pdeathsig);
+		   SEXP wd, SEXP encoding, SEXP tree_id, SEXP linux_pdeathsig,
+		   SEXP pipe_size);
+SEXP processx_exec_many(SEXP specs);
+
+/* The elements of a process specification, a list of the arguments of
+   `processx_exec()`, built by `exec_spec()` in R/initialize.R. */
+#define PROCESSX_EXEC_SPEC_COMMAND           0
+#define PROCESSX_EXEC_SPEC_ARGS              1
+#define PROCESSX_EXEC_SPEC_PTY               2
+#define PROCESSX_EXEC_SPEC_PTY_OPTIONS       3
+#define PROCESSX_EXEC_SPEC_CONNECTIONS       4
+#define PROCESSX_EXEC_SPEC_ENV               5
+#define PROCESSX_EXEC_SPEC_VERBATIM_ARGS     6
+#define PROCESSX_EXEC_SPEC_HIDE_WINDOW       7
+#define PROCESSX_EXEC_SPEC_DETACHED_PROCESS  8
+#define PROCESSX_EXEC_SPEC_PRIVATE           9
+#define PROCESSX_EXEC_SPEC_CLEANUP          10
+#define PROCESSX_EXEC_SPEC_CLEANUP_GRACE    11
+#define PROCESSX_EXEC_SPEC_WD               12
+#define PROCESSX_EXEC_SPEC_ENCODING         13
+#define PROCESSX_EXEC_SPEC_TREE_ID          14
+#define PROCESSX_EXEC_SPEC_LINUX_PDEATHSIG  15
+#define PROCESSX_EXEC_SPEC_PIPE_SIZE        16
+
+/* Start a process from a specification. Returns the handle, or
+   R_NilValue if the command could not be started, and then the error
+   message is in `msg`. This is only on Unix, other errors, e.g. running
+   out of file descriptors, and all errors on Windows are thrown. */
+SEXP processx__exec_spec(SEXP spec, char *msg, size_t msg_size);
 SEXP processx_wait(SEXP status, SEXP timeout, SEXP name);
+SEXP processx_wait_many(SEXP statuses, SEXP timeout, SEXP count);
 SEXP processx_is_alive(SEXP status, SEXP name);
 SEXP processx_pty_close(SEXP status, SEXP name);
 SEXP processx_get_exit_status(SEXP status, SEXP name);
@@ -58,6 +87,37 @@ SEXP processx_get_pid(SEXP status);
 SEXP processx_create_time(SEXP r_pid);
 
 SEXP processx_poll(SEXP statuses, SEXP conn, SEXP ms);
+SEXP processx_poll_sparse(SEXP statuses, SEXP types, SEXP ms);
+
+/* Poll sets */
+SEXP processx_pollset_create(void);
+SEXP processx_pollset_add(SEXP xps, SEXP object, SEXP type);
+SEXP processx_pollset_remove(SEXP xps, SEXP id);
+SEXP processx_pollset_size(SEXP xps);
+SEXP processx_pollset_wait(SEXP xps, SEXP ms);
+
+SEXP processx_buffer_pool_stats(void);
+
+SEXP processx_run_create(SEXP out, SEXP err, SEXP lines, SEXP binary);
+SEXP processx_run_collect(SEXP xrun, SEXP ms);
+SEXP processx_run_input(SEXP xrun, SEXP in, SEXP input);
+SEXP processx_run_result(SEXP xrun);
+
+SEXP processx_pool_create(SEXP max_parallel);
+SEXP processx_pool_submit(SEXP xpool, SEXP spec, SEXP collect, SEXP timeout);
+SEXP processx_pool_wait(SEXP xpool, SEXP ms);
+SEXP processx_pool_kill(SEXP xpool);
+SEXP processx_pool_stats(SEXP xpool);
+
+SEXP processx_spawn_server_create(SEXP conn);
+SEXP processx_spawn_server_spawn(SEXP xserver, SEXP command, SEXP args,
+				 SEXP env, SEXP wd, SEXP stdio, SEXP paths,
+				 SEXP encoding);
+SEXP processx_spawn_server_wait(SEXP xserver, SEXP pid, SEXP ms);
+
+/* Pollable for the termination of a process */
+int processx_c_pollable_from_process(processx_pollable_t *pollable,
+				     processx_handle_t *handle);
 
 SEXP processx__process_exists(SEXP pid);
 SEXP processx__proc_start_time(SEXP status);
@@ -78,6 +138,10 @@ SEXP processx_write_raw_stdout(SEXP raw_data);
 
 /* Common declarations */
 
+/* Connection buffers, see bufpool.c */
+void *processx__pool_alloc(size_t size, int *pooled);
+void processx__pool_free(void *ptr, int pooled);
+
 /* Interruption interval in ms */
 #define PROCESSX_INTERRUPT_INTERVAL 200
 
@@ -107,6 +171,7 @@ SEXP processx_write_raw_stdout(SEXP raw_data);
 
 #define PXHANDLE  8             /* need to poll the set handle */
 #define PXSELECT  9             /* need to poll/select the set fd */
+#define PXWAIT    10            /* need to wait on the set process handle */
 
 typedef struct {
   int windows_verbatim_args;
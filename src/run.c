@@ -0,0 +1,330 @@
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "processx.h"
+
+/* Output collection for `run()`
+ *
+ * This is the fast path of `run()`, for the common case, when the
+ * output is collected, and there are no chunk callbacks, no spinner,
+ * and no pty. We poll and read the standard output and error here, and
+ * only return to R if there are complete lines for the line callbacks,
+ * the timeout expired, or both streams are at EOF.
+ *
+ * The collected output is kept in the external pointer, so that it is
+ * not lost if the user interrupts R while we are polling.
+ *
+ * `process$communicate()` uses the same machinery, and it can also feed
+ * the standard input of the process, from a raw vector or a file, see
+ * `processx_run_input()`. The input is written via the write queue of
+ * the connection, so it is interleaved with reading the output, and the
+ * child cannot deadlock on a full pipe.
+ */
+
+typedef struct processx_run_stream_s {
+  processx_connection_t *ccon;
+  int lines;			/* return complete lines to R? */
+  char *data;
+  size_t size, allocated;
+  size_t line_start;		/* first byte not yet returned as a line */
+} processx_run_stream_t;
+
+typedef struct processx_run_input_s {
+  processx_connection_t *ccon;	/* NULL if there is no (more) input */
+  FILE *file;			/* input file, or NULL for a raw vector */
+  const char *data;		/* the raw vector */
+  size_t size, pos;
+} processx_run_input_t;
+
+typedef struct processx_run_s {
+  processx_run_stream_t streams[2];
+  processx_run_input_t input;
+  int binary;
+} processx_run_t;
+
+#define PROCESSX__RUN_CHUNK (64 * 1024)
+
+static void processx__run_finalizer(SEXP xrun) {
+  processx_run_t *run = R_ExternalPtrAddr(xrun);
+  if (!run) return;
+  if (run->input.file) fclose(run->input.file);
+  free(run->streams[0].data);
+  free(run->streams[1].data);
+  free(run);
+  R_ClearExternalPtr(xrun);
+}
+
+static processx_run_t *processx__run_get(SEXP xrun) {
+  processx_run_t *run = R_ExternalPtrAddr(xrun);
+  if (!run) R_THROW_ERROR("Invalid run() state, already finalized");
+  return run;
+}
+
+static double processx__run_now(void) {
+#ifdef _WIN32
+  return (double) GetTickCount64();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+#endif
+}
+
+/* Read everything that is available, without waiting */
+
+static void processx__run_drain(processx_run_t *run,
+				processx_run_stream_t *stream) {
+  for (;;) {
+    ssize_t n;
+    if (stream->allocated - stream->size < PROCESSX__RUN_CHUNK) {
+      size_t newsize = stream->allocated ? stream->allocated * 2 :
+	PROCESSX__RUN_CHUNK * 2;
+      char *newdata = realloc(stream->data, newsize);
+      if (!newdata) R_THROW_ERROR("Cannot collect output, out of memory");
+      stream->data = newdata;
+      stream->allocated = newsize;
+    }
+    if (run->binary) {
+      n = processx_c_connection_read_bytes(
+        stream->ccon, stream->data + stream->size, PROCESSX__RUN_CHUNK);
+    } else {
+      n = processx_c_connection_read_chars(
+        stream->ccon, stream->data + stream->size, PROCESSX__RUN_CHUNK);
+    }
+    if (n <= 0) break;
+    stream->size += n;
+  }
+}
+
+/* Complete lines since the last call, without the newlines */
+
+static SEXP processx__run_lines(processx_run_stream_t *stream) {
+  const char *start = stream->data + stream->line_start;
+  const char *end = stream->data + stream->size, *nl;
+  size_t l, nlines = 0;
+  SEXP result;
+
+  if (!stream->lines) return R_NilValue;
+
+  for (nl = start; nl < end && (nl = memchr(nl, '\n', end - nl)); nl++) {
+    nlines++;
+  }
+
+  result = PROTECT(allocVector(STRSXP, nlines));
+  for (l = 0; l < nlines; l++) {
+    int slashr;
+    nl = memchr(start, '\n', end - start);
+    slashr = nl > start && nl[-1] == '\r';
+    SET_STRING_ELT(result, l, mkCharLenCE(start, (int) (nl - start - slashr),
+					  CE_UTF8));
+    start = nl + 1;
+  }
+  stream->line_start = start - stream->data;
+
+  UNPROTECT(1);
+  return result;
+}
+
+SEXP processx_run_create(SEXP out, SEXP err, SEXP lines, SEXP binary) {
+  processx_run_t *run = calloc(1, sizeof(processx_run_t));
+  SEXP result, prot;
+
+  if (!run) R_THROW_ERROR("Cannot collect output, out of memory");
+  run->binary = LOGICAL(binary)[0];
+  if (!isNull(out)) {
+    run->streams[0].ccon = R_ExternalPtrAddr(out);
+    run->streams[0].lines = LOGICAL(lines)[0];
+  }
+  if (!isNull(err)) {
+    run->streams[1].ccon = R_ExternalPtrAddr(err);
+    run->streams[1].lines = LOGICAL(lines)[1];
+  }
+
+  /* Keep the connections alive as long as we need them. The third and
+     fourth are the input connection and the input, see
+     `processx_run_input()`. */
+  prot = PROTECT(allocVector(VECSXP, 4));
+  SET_VECTOR_ELT(prot, 0, out);
+  SET_VECTOR_ELT(prot, 1, err);
+  result = PROTECT(R_MakeExternalPtr(run, R_NilValue, prot));
+  R_RegisterCFinalizerEx(result, processx__run_finalizer, 1);
+
+  UNPROTECT(2);
+  return result;
+}
+
+/* Feed the standard input, in chunks, whenever the write queue of the
+   connection is empty. Once the input is all written, we close the
+   connection, so the child sees EOF. If the child closed its end, the
+   rest of the input is dropped. */
+
+static void processx__run_feed(processx_run_t *run) {
+  processx_run_input_t *input = &run->input;
+  processx_connection_t *ccon = input->ccon;
+  int eof = 0;
+  if (!ccon) return;
+
+  for (;;) {
+    char chunk[PROCESSX__RUN_CHUNK];
+    const char *next = chunk;
+    size_t n;
+    if (processx_c_connection_flush(ccon) > 0 || ccon->write_error) break;
+    if (input->file) {
+      n = fread(chunk, 1, sizeof(chunk), input->file);
+      if (n == 0 && ferror(input->file)) {
+	R_THROW_ERROR("Cannot read input file");
+      }
+    } else {
+      n = input->size - input->pos;
+      if (n > PROCESSX__RUN_CHUNK) n = PROCESSX__RUN_CHUNK;
+      next = input->data + input->pos;
+      input->pos += n;
+    }
+    if (n == 0) {
+      eof = 1;
+      break;
+    }
+    processx_c_connection_queue(ccon, next, n);
+  }
+
+  if (eof || ccon->write_error) {
+    ccon->write_error = 0;
+    processx_c_connection_close(ccon);
+    input->ccon = NULL;
+    if (input->file) {
+      fclose(input->file);
+      input->file = NULL;
+    }
+  }
+}
+
+/* Set the input of the process: `input` is a raw vector, or the name of
+   a file. `in` is the standard input connection. */
+
+SEXP processx_run_input(SEXP xrun, SEXP in, SEXP input) {
+  processx_run_t *run = processx__run_get(xrun);
+  processx_connection_t *ccon = R_ExternalPtrAddr(in);
+  SEXP prot = R_ExternalPtrProtected(xrun);
+
+  if (!ccon) R_THROW_ERROR("Invalid connection object");
+  if (run->input.ccon) R_THROW_ERROR("Input was already set");
+
+  if (TYPEOF(input) == RAWSXP) {
+    run->input.data = (const char*) RAW(input);
+    run->input.size = XLENGTH(input);
+    run->input.pos = 0;
+  } else {
+    const char *path = CHAR(STRING_ELT(input, 0));
+    run->input.file = fopen(path, "rb");
+    if (!run->input.file) {
+      R_THROW_SYSTEM_ERROR("Cannot open input file `%s`", path);
+    }
+  }
+  SET_VECTOR_ELT(prot, 2, in);
+  SET_VECTOR_ELT(prot, 3, input);
+  run->input.ccon = ccon;
+
+  processx__run_feed(run);
+  return R_NilValue;
+}
+
+/* Returns a list: whether both streams are at EOF, and all input was
+   written, and the new complete lines of stdout and stderr, if they were
+   requested. `ms` is a timeout, -1 means no timeout. */
+
+SEXP processx_run_collect(SEXP xrun, SEXP ms) {
+  processx_run_t *run = processx__run_get(xrun);
+  int cms = INTEGER(ms)[0];
+  double deadline = cms < 0 ? 0 : processx__run_now() + cms;
+  processx_pollable_t pollables[3];
+  int done = 0, i;
+  SEXP result;
+
+  for (;;) {
+    int newlines = 0;
+    size_t npollables = 0;
+    done = 1;
+
+    processx__run_feed(run);
+    if (run->input.ccon) {
+      done = 0;
+      processx_c_pollable_from_connection_write(pollables + npollables,
+						run->input.ccon);
+      /* Wake up when the queue is empty, to feed the next chunk */
+      pollables[npollables].write = PROCESSX_WRITE_DRAIN;
+      npollables++;
+    }
+
+    for (i = 0; i < 2; i++) {
+      processx_run_stream_t *stream = run->streams + i;
+      if (!stream->ccon) continue;
+      /* Closed by someone else, there is nothing more to read */
+      if (processx_c_connection_is_closed(stream->ccon)) continue;
+      if (!processx_c_connection_is_eof(stream->ccon)) {
+	processx__run_drain(run, stream);
+      }
+      if (stream->lines && stream->size > stream->line_start &&
+	  memchr(stream->data + stream->line_start, '\n',
+		 stream->size - stream->line_start)) {
+	newlines = 1;
+      }
+      if (!processx_c_connection_is_eof(stream->ccon)) {
+	done = 0;
+	processx_c_pollable_from_connection(pollables + npollables,
+					    stream->ccon);
+	npollables++;
+      }
+    }
+
+    if (done || newlines) break;
+
+    if (cms >= 0) {
+      double left = deadline - processx__run_now();
+      if (left <= 0) break;
+      processx_c_connection_poll(pollables, npollables, (int) left);
+    } else {
+      processx_c_connection_poll(pollables, npollables, -1);
+    }
+  }
+
+  result = PROTECT(allocVector(VECSXP, 3));
+  SET_VECTOR_ELT(result, 0, ScalarLogical(done));
+  SET_VECTOR_ELT(result, 1, processx__run_lines(run->streams));
+  SET_VECTOR_ELT(result, 2, processx__run_lines(run->streams + 1));
+
+  UNPROTECT(1);
+  return result;
+}
+
+/* The collected standard output and error */
+
+SEXP processx_run_result(SEXP xrun) {
+  processx_run_t *run = processx__run_get(xrun);
+  SEXP result = PROTECT(allocVector(VECSXP, 2));
+  int i;
+
+  for (i = 0; i < 2; i++) {
+    processx_run_stream_t *stream = run->streams + i;
+    SEXP elt;
+    if (!stream->ccon) continue;
+    if (run->binary) {
+      elt = PROTECT(allocVector(RAWSXP, stream->size));
+      if (stream->size > 0) memcpy(RAW(elt), stream->data, stream->size);
+    } else {
+      if (stream->size > INT_MAX) {
+	R_THROW_ERROR("Output is too long for an R string, %.0f bytes",
+		      (double) stream->size);
+      }
+      elt = PROTECT(ScalarString(
+        mkCharLenCE(stream->data ? stream->data : "", (int) stream->size,
+		    CE_UTF8)));
+    }
+    SET_VECTOR_ELT(result, i, elt);
+    UNPROTECT(1);
+  }
+
+  UNPROTECT(1);
+  return result;
+}
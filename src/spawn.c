@@ -0,0 +1,313 @@
+#include <string.h>
+#include <time.h>
+
+#include "processx.h"
+
+/* Client of the spawn server
+ *
+ * The spawn server is a small helper program, it starts processes on
+ * behalf of R, see spawnserver/spawnserver.c. We talk to it over a Unix
+ * socket, with the messages in spawnserver/protocol.h.
+ *
+ * The server sends the exit statuses of its processes whenever they
+ * exit, so we might read them while we are waiting for something else.
+ * We keep them in the external pointer, until R asks for them.
+ */
+
+#ifndef _WIN32
+
+#include <sys/uio.h>
+
+#include "spawnserver/protocol.h"
+
+#ifndef MSG_CMSG_CLOEXEC
+#define MSG_CMSG_CLOEXEC 0
+#endif
+
+extern char **environ;
+
+typedef struct processx_spawn_exit_s {
+  pid_t pid;
+  int status;
+} processx_spawn_exit_t;
+
+typedef struct processx_spawn_server_s {
+  int fd;
+  processx_spawn_exit_t *exits;
+  size_t num_exits, size_exits;
+} processx_spawn_server_t;
+
+static void processx__spawn_finalizer(SEXP xserver) {
+  processx_spawn_server_t *server = R_ExternalPtrAddr(xserver);
+  if (!server) return;
+  free(server->exits);
+  free(server);
+  R_ClearExternalPtr(xserver);
+}
+
+static double processx__spawn_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static processx_spawn_server_t *processx__spawn_get(SEXP xserver) {
+  processx_spawn_server_t *server = R_ExternalPtrAddr(xserver);
+  if (!server) R_THROW_ERROR("Invalid spawn server, already finalized");
+  return server;
+}
+
+static void processx__spawn_write(processx_spawn_server_t *server,
+				  const void *buf, size_t n) {
+  const char *p = buf;
+  while (n > 0) {
+    ssize_t ret = write(server->fd, p, n);
+    if (ret == -1 && errno == EINTR) continue;
+    if (ret == -1) R_THROW_SYSTEM_ERROR("Cannot write to spawn server");
+    p += ret;
+    n -= ret;
+  }
+}
+
+/* Read a message, and the fds attached to it. `fds` has room for three
+   fds, and the unused ones are set to -1. */
+
+static void processx__spawn_read(processx_spawn_server_t *server,
+				 processx_spawn_msg_t *msg, int *fds) {
+  char cbuf[CMSG_SPACE(3 * sizeof(int))];
+  struct msghdr hdr;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  char *p = (char*) msg;
+  size_t left = sizeof(*msg);
+  ssize_t ret;
+
+  fds[0] = fds[1] = fds[2] = -1;
+  iov.iov_base = msg;
+  iov.iov_len = sizeof(*msg);
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.msg_iov = &iov;
+  hdr.msg_iovlen = 1;
+  hdr.msg_control = cbuf;
+  hdr.msg_controllen = sizeof(cbuf);
+
+  do {
+    ret = recvmsg(server->fd, &hdr, MSG_CMSG_CLOEXEC);
+  } while (ret == -1 && errno == EINTR);
+  if (ret == -1) R_THROW_SYSTEM_ERROR("Cannot read from spawn server");
+  if (ret == 0) R_THROW_ERROR("Spawn server has exited");
+
+  for (cmsg = CMSG_FIRSTHDR(&hdr); cmsg; cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+      size_t i, nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      if (nfds > 3) nfds = 3;
+      memcpy(fds, CMSG_DATA(cmsg), nfds * sizeof(int));
+      for (i = 0; i < nfds; i++) processx__cloexec_fcntl(fds[i], 1);
+    }
+  }
+
+  /* The rest of a partial message, without fds */
+  p += ret;
+  left -= ret;
+  while (left > 0) {
+    ret = read(server->fd, p, left);
+    if (ret == -1 && errno == EINTR) continue;
+    if (ret == -1) R_THROW_SYSTEM_ERROR("Cannot read from spawn server");
+    if (ret == 0) R_THROW_ERROR("Spawn server has exited");
+    p += ret;
+    left -= ret;
+  }
+}
+
+static void processx__spawn_add_exit(processx_spawn_server_t *server,
+				     processx_spawn_msg_t *msg) {
+  processx_spawn_exit_t *ex;
+  if (server->num_exits == server->size_exits) {
+    size_t newsize = server->size_exits ? server->size_exits * 2 : 16;
+    void *p = realloc(server->exits, newsize * sizeof(processx_spawn_exit_t));
+    if (!p) R_THROW_ERROR("Cannot record exit status, out of memory");
+    server->exits = p;
+    server->size_exits = newsize;
+  }
+  ex = server->exits + server->num_exits++;
+  ex->pid = msg->pid;
+  if (WIFEXITED(msg->value)) {
+    ex->status = WEXITSTATUS(msg->value);
+  } else {
+    ex->status = - WTERMSIG(msg->value);
+  }
+}
+
+/* `conn` is our end of the socket to the server */
+
+SEXP processx_spawn_server_create(SEXP conn) {
+  processx_connection_t *ccon = R_ExternalPtrAddr(conn);
+  processx_spawn_server_t *server;
+  SEXP result;
+
+  if (!ccon) R_THROW_ERROR("Invalid connection object");
+  server = calloc(1, sizeof(processx_spawn_server_t));
+  if (!server) R_THROW_ERROR("Cannot create spawn server, out of memory");
+  server->fd = processx_c_connection_fileno(ccon);
+
+  /* The connection owns the fd, so we keep it alive */
+  result = PROTECT(R_MakeExternalPtr(server, R_NilValue, conn));
+  R_RegisterCFinalizerEx(result, processx__spawn_finalizer, 1);
+
+  UNPROTECT(1);
+  return result;
+}
+
+/* `stdio` is three integers, see `PROCESSX_SPAWN_*` in protocol.h, and
+   `paths` has the file names for the `PROCESSX_SPAWN_FILE` streams. `env`
+   is `NULL` to use the current environment. Returns the pid and the
+   connections of the pipes, `NULL` for the other streams. */
+
+SEXP processx_spawn_server_spawn(SEXP xserver, SEXP command, SEXP args,
+				 SEXP env, SEXP wd, SEXP stdio, SEXP paths,
+				 SEXP encoding) {
+  processx_spawn_server_t *server = processx__spawn_get(xserver);
+  const char *cencoding = CHAR(STRING_ELT(encoding, 0));
+  processx_spawn_request_t req;
+  processx_spawn_msg_t msg;
+  const char **strs;
+  size_t i, nstrs = 0, len = 0;
+  R_xlen_t nargs = XLENGTH(args), nenv = 0;
+  int fds[3], nfd = 0;
+  char *buf, *p;
+  SEXP result, cons;
+
+  if (isNull(env)) {
+    while (environ[nenv]) nenv++;
+  } else {
+    nenv = XLENGTH(env);
+  }
+
+  strs = (const char**) R_alloc(nargs + nenv + 5, sizeof(char*));
+  strs[nstrs++] = CHAR(STRING_ELT(command, 0));
+  strs[nstrs++] = isNull(wd) ? "" : CHAR(STRING_ELT(wd, 0));
+  for (i = 0; i < nargs; i++) strs[nstrs++] = CHAR(STRING_ELT(args, i));
+  for (i = 0; i < nenv; i++) {
+    strs[nstrs++] = isNull(env) ? environ[i] : CHAR(STRING_ELT(env, i));
+  }
+  for (i = 0; i < 3; i++) {
+    req.stdio[i] = INTEGER(stdio)[i];
+    if (req.stdio[i] == PROCESSX_SPAWN_FILE) {
+      strs[nstrs++] = CHAR(STRING_ELT(paths, i));
+    }
+  }
+
+  for (i = 0; i < nstrs; i++) len += strlen(strs[i]) + 1;
+  if (len > INT32_MAX) R_THROW_ERROR("Spawn request is too large");
+  p = buf = R_alloc(len, 1);
+  for (i = 0; i < nstrs; i++) {
+    size_t l = strlen(strs[i]) + 1;
+    memcpy(p, strs[i], l);
+    p += l;
+  }
+
+  req.type = PROCESSX_SPAWN_REQUEST;
+  req.len = (int32_t) len;
+  req.argc = (int32_t) nargs;
+  req.envc = (int32_t) nenv;
+  processx__spawn_write(server, &req, sizeof(req));
+  processx__spawn_write(server, buf, len);
+
+  /* Exit messages of other processes might come before the reply */
+  for (;;) {
+    processx__spawn_read(server, &msg, fds);
+    if (msg.type == PROCESSX_SPAWN_REPLY) break;
+    if (msg.type == PROCESSX_SPAWN_EXIT) processx__spawn_add_exit(server, &msg);
+  }
+
+  if (msg.value != 0) {
+    for (i = 0; i < 3; i++) if (fds[i] >= 0) close(fds[i]);
+    R_THROW_SYSTEM_ERROR_CODE(msg.value, "cannot start processx process '%s'",
+			      CHAR(STRING_ELT(command, 0)));
+  }
+
+  result = PROTECT(allocVector(VECSXP, 2));
+  SET_VECTOR_ELT(result, 0, ScalarInteger(msg.pid));
+  cons = PROTECT(allocVector(VECSXP, 3));
+  for (i = 0; i < 3; i++) {
+    SEXP con;
+    if (req.stdio[i] != PROCESSX_SPAWN_PIPE) continue;
+    processx__nonblock_fcntl(fds[nfd], 1);
+    processx_c_connection_create(fds[nfd++], PROCESSX_FILE_TYPE_ASYNCPIPE,
+				 cencoding, NULL, &con);
+    SET_VECTOR_ELT(cons, i, con);
+  }
+  SET_VECTOR_ELT(result, 1, cons);
+
+  UNPROTECT(2);
+  return result;
+}
+
+/* Wait for the exit of `pid`, for at most `ms` milliseconds, -1 means no
+   timeout. Returns the exit status, or `NULL` on timeout. */
+
+SEXP processx_spawn_server_wait(SEXP xserver, SEXP pid, SEXP ms) {
+  processx_spawn_server_t *server = processx__spawn_get(xserver);
+  pid_t cpid = INTEGER(pid)[0];
+  int cms = INTEGER(ms)[0];
+  double deadline = cms < 0 ? 0 : processx__spawn_now() + cms;
+  struct pollfd pfd;
+
+  pfd.fd = server->fd;
+  pfd.events = POLLIN;
+
+  for (;;) {
+    size_t i;
+    int ret, left = -1;
+    for (i = 0; i < server->num_exits; i++) {
+      if (server->exits[i].pid == cpid) {
+	int status = server->exits[i].status;
+	server->exits[i] = server->exits[--server->num_exits];
+	return ScalarInteger(status);
+      }
+    }
+
+    if (cms >= 0) {
+      double dleft = deadline - processx__spawn_now();
+      if (dleft <= 0) return R_NilValue;
+      left = (int) dleft + 1;
+    }
+    ret = processx__interruptible_poll(&pfd, 1, left);
+    if (ret == -1) R_THROW_SYSTEM_ERROR("Cannot poll spawn server");
+    if (ret == 0) return R_NilValue;
+
+    /* Read all messages that are available. There are no replies here,
+       because spawning waits for its reply. */
+    do {
+      processx_spawn_msg_t msg;
+      int fds[3];
+      processx__spawn_read(server, &msg, fds);
+      for (i = 0; i < 3; i++) if (fds[i] >= 0) close(fds[i]);
+      if (msg.type == PROCESSX_SPAWN_EXIT) {
+	processx__spawn_add_exit(server, &msg);
+      }
+      pfd.revents = 0;
+    } while (poll(&pfd, 1, 0) > 0);
+  }
+}
+
+#else
+
+SEXP processx_spawn_server_create(SEXP conn) {
+  R_THROW_ERROR("The spawn server is not supported on Windows");
+  return R_NilValue;
+}
+
+SEXP processx_spawn_server_spawn(SEXP xserver, SEXP command, SEXP args,
+				 SEXP env, SEXP wd, SEXP stdio, SEXP paths,
+				 SEXP encoding) {
+  R_THROW_ERROR("The spawn server is not supported on Windows");
+  return R_NilValue;
+}
+
+SEXP processx_spawn_server_wait(SEXP xserver, SEXP pid, SEXP ms) {
+  R_THROW_ERROR("The spawn server is not supported on Windows");
+  return R_NilValue;
+}
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef PROCESSX_SPAWNSERVER_PROTOCOL_H
+#define PROCESSX_SPAWNSERVER_PROTOCOL_H
+
+// Messages between R and the spawn server, over a Unix socket.
+//
+// A request is a `processx_spawn_request_t`, followed by `len` bytes of
+// zero terminated strings: the command, the working directory (empty for
+// the working directory of the server), `argc` arguments, `envc`
+// environment variables, and the file names of the `PROCESSX_SPAWN_FILE`
+// streams, in the order of the streams.
+//
+// The server answers with a `PROCESSX_SPAWN_REPLY` message. If the process
+// was started, then the message has the R ends of the
+// `PROCESSX_SPAWN_PIPE` streams attached, as SCM_RIGHTS ancillary data,
+// in the order of the streams. The server sends a `PROCESSX_SPAWN_EXIT`
+// message when a process has exited.
+
+#include <stdint.h>
+
+#define PROCESSX_SPAWN_REQUEST 1
+#define PROCESSX_SPAWN_REPLY   2
+#define PROCESSX_SPAWN_EXIT    3
+
+// How to set up a standard stream of the new process
+#define PROCESSX_SPAWN_NULL    0
+#define PROCESSX_SPAWN_PIPE    1
+#define PROCESSX_SPAWN_FILE    2
+#define PROCESSX_SPAWN_STDOUT  3  // stderr only, same as stdout
+
+typedef struct processx_spawn_request_s {
+  int32_t type;
+  int32_t len;
+  int32_t argc;
+  int32_t envc;
+  int32_t stdio[3];
+} processx_spawn_request_t;
+
+typedef struct processx_spawn_msg_s {
+  int32_t type;
+  int32_t pid;
+  int32_t value;  // reply: errno, 0 on success; exit: the wait status
+} processx_spawn_msg_t;
+
+#endif
@@ -0,0 +1,387 @@
+// This spawn server starts processes on behalf of an R process. R starts
+// it once, with one end of a Unix socket as file descriptor 3. Then R
+// sends spawn requests on the socket, and the server forks and execs the
+// new processes, and sends back their pids and the R ends of their
+// standard streams. See protocol.h for the messages.
+//
+// The R process can be huge, and then even `vfork()` has a cost, e.g.
+// for blocking and restoring the signals, and for the child list. This
+// server is small, so forking it is cheap, and it does not depend on the
+// size of the R heap.
+//
+// The processes are children of the server, so the server reaps them,
+// and sends their wait status to R. When the socket is closed, e.g.
+// because R exited, the server kills the processes it started, and exits.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#include "protocol.h"
+
+// The socket to R
+#define SOCK_FD 3
+
+extern char **environ;
+
+static int sigchld_pipe[2] = { -1, -1 };
+
+static pid_t *children = NULL;
+static size_t num_children = 0, size_children = 0;
+
+// Utilities ------------------------------------------------------------------
+
+static void set_cloexec(int fd) {
+  int flags = fcntl(fd, F_GETFD);
+  if (flags != -1) fcntl(fd, F_SETFD, flags | FD_CLOEXEC);
+}
+
+static int read_full(int fd, void *buf, size_t n) {
+  char *p = buf;
+  while (n > 0) {
+    ssize_t ret = read(fd, p, n);
+    if (ret == -1 && errno == EINTR) continue;
+    if (ret <= 0) return -1;
+    p += ret;
+    n -= ret;
+  }
+  return 0;
+}
+
+static void send_msg(int type, pid_t pid, int value, int *fds, int nfds) {
+  processx_spawn_msg_t msg;
+  struct msghdr hdr;
+  struct iovec iov;
+  char cbuf[CMSG_SPACE(3 * sizeof(int))];
+  ssize_t ret;
+
+  msg.type = type;
+  msg.pid = pid;
+  msg.value = value;
+  iov.iov_base = &msg;
+  iov.iov_len = sizeof(msg);
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.msg_iov = &iov;
+  hdr.msg_iovlen = 1;
+
+  if (nfds > 0) {
+    struct cmsghdr *cmsg;
+    memset(cbuf, 0, sizeof(cbuf));
+    hdr.msg_control = cbuf;
+    hdr.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+    cmsg = CMSG_FIRSTHDR(&hdr);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+  }
+
+  do {
+    ret = sendmsg(SOCK_FD, &hdr, 0);
+  } while (ret == -1 && errno == EINTR);
+
+  // The message is small, so a partial write only happens if the socket
+  // buffer is almost full. Then we send the rest without the fds.
+  if (ret > 0 && ret < (ssize_t) sizeof(msg)) {
+    char *p = (char*) &msg + ret;
+    size_t left = sizeof(msg) - ret;
+    while (left > 0) {
+      ret = write(SOCK_FD, p, left);
+      if (ret == -1 && errno == EINTR) continue;
+      if (ret <= 0) break;
+      p += ret;
+      left -= ret;
+    }
+  }
+}
+
+static void add_child(pid_t pid) {
+  if (num_children == size_children) {
+    size_t newsize = size_children ? size_children * 2 : 64;
+    pid_t *newchildren = realloc(children, newsize * sizeof(pid_t));
+    if (!newchildren) return;
+    children = newchildren;
+    size_children = newsize;
+  }
+  children[num_children++] = pid;
+}
+
+static void remove_child(pid_t pid) {
+  size_t i;
+  for (i = 0; i < num_children; i++) {
+    if (children[i] == pid) {
+      children[i] = children[--num_children];
+      return;
+    }
+  }
+}
+
+// Signals --------------------------------------------------------------------
+
+static void sigchld_handler(int sig) {
+  int saved_errno = errno;
+  ssize_t ret = write(sigchld_pipe[1], "x", 1);
+  (void) sig;
+  (void) ret;
+  errno = saved_errno;
+}
+
+static void reap_children(void) {
+  char buf[256];
+  pid_t pid;
+  int wstat;
+
+  while (read(sigchld_pipe[0], buf, sizeof(buf)) > 0) ;
+
+  for (;;) {
+    pid = waitpid(-1, &wstat, WNOHANG);
+    if (pid == -1 && errno == EINTR) continue;
+    if (pid <= 0) break;
+    remove_child(pid);
+    send_msg(PROCESSX_SPAWN_EXIT, pid, wstat, NULL, 0);
+  }
+}
+
+// Starting a process ---------------------------------------------------------
+
+static void close_fds(int *fds, int n) {
+  int i;
+  for (i = 0; i < n; i++) {
+    if (fds[i] >= 0) close(fds[i]);
+    fds[i] = -1;
+  }
+}
+
+// Returns -1 if the socket was closed, 0 otherwise.
+
+static int handle_request(void) {
+  processx_spawn_request_t req;
+  char *buf = NULL, *p, *end, *command, *wd;
+  char **args = NULL, **env = NULL;
+  int child_fds[3] = { -1, -1, -1 }, parent_fds[3] = { -1, -1, -1 };
+  int send_fds[3], nsend = 0;
+  int errpipe[2] = { -1, -1 };
+  int i, err = 0;
+  pid_t pid = 0;
+
+  if (read_full(SOCK_FD, &req, sizeof(req)) == -1) return -1;
+  if (req.type != PROCESSX_SPAWN_REQUEST || req.len < 0 || req.argc < 0 ||
+      req.envc < 0) {
+    return -1;
+  }
+
+  buf = malloc(req.len + 1);
+  args = calloc(req.argc + 1, sizeof(char*));
+  env = calloc(req.envc + 1, sizeof(char*));
+  if (!buf || !args || !env) {
+    // We still need to consume the request
+    char skip[4096];
+    int left = req.len;
+    while (left > 0) {
+      int n = left < (int) sizeof(skip) ? left : (int) sizeof(skip);
+      if (read_full(SOCK_FD, skip, n) == -1) return -1;
+      left -= n;
+    }
+    err = ENOMEM;
+    goto done;
+  }
+  if (read_full(SOCK_FD, buf, req.len) == -1) {
+    free(buf);
+    free(args);
+    free(env);
+    return -1;
+  }
+  buf[req.len] = '\0';
+
+  // Split the strings
+  p = buf;
+  end = buf + req.len;
+#define NEXT_STRING(var) do {			\
+    if (p >= end) { err = EINVAL; goto done; }	\
+    var = p;					\
+    p += strlen(p) + 1;				\
+  } while (0)
+
+  NEXT_STRING(command);
+  NEXT_STRING(wd);
+  for (i = 0; i < req.argc; i++) NEXT_STRING(args[i]);
+  for (i = 0; i < req.envc; i++) NEXT_STRING(env[i]);
+
+  // Standard streams
+  for (i = 0; i < 3; i++) {
+    int fds[2], flags;
+    char *path;
+    switch (req.stdio[i]) {
+    case PROCESSX_SPAWN_PIPE:
+      if (pipe(fds) == -1) {
+        err = errno;
+        goto done;
+      }
+      set_cloexec(fds[0]);
+      set_cloexec(fds[1]);
+      child_fds[i] = i == 0 ? fds[0] : fds[1];
+      parent_fds[i] = i == 0 ? fds[1] : fds[0];
+      break;
+    case PROCESSX_SPAWN_FILE:
+      NEXT_STRING(path);
+      flags = i == 0 ? O_RDONLY : O_WRONLY | O_CREAT | O_TRUNC;
+      child_fds[i] = open(path, flags | O_CLOEXEC, 0644);
+      if (child_fds[i] == -1) {
+        err = errno;
+        goto done;
+      }
+      break;
+    case PROCESSX_SPAWN_STDOUT:
+      if (i != 2) {
+        err = EINVAL;
+        goto done;
+      }
+      break;
+    default:
+      child_fds[i] = open("/dev/null", i == 0 ? O_RDONLY : O_WRONLY);
+      if (child_fds[i] == -1) {
+        err = errno;
+        goto done;
+      }
+      set_cloexec(child_fds[i]);
+      break;
+    }
+  }
+#undef NEXT_STRING
+
+  // The child reports exec() errors on this pipe. If exec() works, the
+  // pipe is closed, and we read EOF.
+  if (pipe(errpipe) == -1) {
+    err = errno;
+    goto done;
+  }
+  set_cloexec(errpipe[0]);
+  set_cloexec(errpipe[1]);
+
+  pid = fork();
+  if (pid == -1) {
+    err = errno;
+    pid = 0;
+    goto done;
+  }
+
+  if (pid == 0) {
+    sigset_t set;
+    int child_err;
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGPIPE, SIG_DFL);
+    sigemptyset(&set);
+    sigprocmask(SIG_SETMASK, &set, NULL);
+    setsid();
+
+    // All fds are close-on-exec, and the dup2()-d ones are not.
+    dup2(child_fds[0], 0);
+    dup2(child_fds[1], 1);
+    if (req.stdio[2] == PROCESSX_SPAWN_STDOUT) {
+      dup2(1, 2);
+    } else {
+      dup2(child_fds[2], 2);
+    }
+
+    if (wd[0] && chdir(wd) == -1) {
+      child_err = errno;
+    } else {
+      environ = env;
+      execvp(command, args);
+      child_err = errno;
+    }
+    while (write(errpipe[1], &child_err, sizeof(child_err)) == -1 &&
+           errno == EINTR) ;
+    _exit(127);
+  }
+
+  close(errpipe[1]);
+  errpipe[1] = -1;
+  for (;;) {
+    ssize_t ret = read(errpipe[0], &err, sizeof(err));
+    if (ret == -1 && errno == EINTR) continue;
+    if (ret != sizeof(err)) err = 0;
+    break;
+  }
+  if (err != 0) {
+    while (waitpid(pid, NULL, 0) == -1 && errno == EINTR) ;
+    pid = 0;
+  } else {
+    add_child(pid);
+  }
+
+done:
+  close_fds(child_fds, 3);
+  close_fds(errpipe, 2);
+  if (err == 0) {
+    for (i = 0; i < 3; i++) {
+      if (parent_fds[i] >= 0) send_fds[nsend++] = parent_fds[i];
+    }
+  }
+  send_msg(PROCESSX_SPAWN_REPLY, pid, err, send_fds, nsend);
+  close_fds(parent_fds, 3);
+
+  free(buf);
+  free(args);
+  free(env);
+  return 0;
+}
+
+// Main -----------------------------------------------------------------------
+
+int main(int argc, char **argv) {
+  struct sigaction sa;
+  struct pollfd fds[2];
+  size_t i;
+
+  if (argc != 1 || fcntl(SOCK_FD, F_GETFD) == -1) {
+    fprintf(stderr, "%s must be started with a socket at fd 3\n", argv[0]);
+    return 1;
+  }
+  set_cloexec(SOCK_FD);
+
+  if (pipe(sigchld_pipe) == -1) {
+    perror("Cannot create pipe");
+    return 2;
+  }
+  for (i = 0; i < 2; i++) {
+    set_cloexec(sigchld_pipe[i]);
+    int flags = fcntl(sigchld_pipe[i], F_GETFL);
+    fcntl(sigchld_pipe[i], F_SETFL, flags | O_NONBLOCK);
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = sigchld_handler;
+  sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGCHLD, &sa, NULL);
+
+  fds[0].fd = SOCK_FD;
+  fds[0].events = POLLIN;
+  fds[1].fd = sigchld_pipe[0];
+  fds[1].events = POLLIN;
+
+  for (;;) {
+    int ret = poll(fds, 2, -1);
+    if (ret == -1 && errno == EINTR) continue;
+    if (ret == -1) break;
+
+    if (fds[1].revents) reap_children();
+    if (fds[0].revents) {
+      if (handle_request() == -1) break;
+    }
+  }
+
+  for (i = 0; i < num_children; i++) kill(children[i], SIGKILL);
+  return 0;
+}
@@ -0,0 +1,355 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../processx.h"
+
+/* Background reading of child process output.
+ *
+ * A single helper thread, owned by processx, reads from the registered
+ * connections while the R thread is busy, so the child does not block
+ * on a full pipe. The data is kept in a per-connection staging buffer,
+ * and the R thread takes it from there, instead of calling `read()`,
+ * see `processx__bgread_read()`. The R thread never touches the
+ * connection buffers of other connections, so the rest of the connection
+ * code does not need to know about the thread at all.
+ *
+ * Each connection has a notify pipe, which has a byte in it if and only
+ * if there is data in the staging buffer, or the connection reached EOF.
+ * The R thread polls the notify pipe instead of the connection.
+ *
+ * The thread holds the lock while reading, and releases it while it is
+ * waiting in `poll()`. Registering and unregistering connections bumps
+ * the generation counter, and wakes up the thread via the control pipe;
+ * the thread drops the results of a `poll()` call if the set of
+ * connections changed meanwhile. */
+
+#define PROCESSX__BGREAD_CHUNK (64 * 1024)
+#define PROCESSX__BGREAD_MAX (16 * 1024 * 1024)
+
+typedef struct processx__bgread_s {
+  int fd;
+  int notify[2];
+  int notified;
+  int eof;
+  int error;			/* errno of a failed read, or 0 */
+  char *data;
+  size_t start, size, allocated;
+  struct processx__bgread_s *next;
+} processx__bgread_t;
+
+static pthread_mutex_t processx__bgread_lock = PTHREAD_MUTEX_INITIALIZER;
+static processx__bgread_t *processx__bgread_list = NULL;
+static size_t processx__bgread_count = 0;
+static unsigned long processx__bgread_generation = 0;
+static int processx__bgread_control[2] = { -1, -1 };
+static int processx__bgread_running = 0;
+static int processx__bgread_stopping = 0;
+static pthread_t processx__bgread_thread_id;
+
+static void processx__bgread_wakeup(void) {
+  ssize_t ret;
+  do {
+    ret = write(processx__bgread_control[1], "x", 1);
+  } while (ret == -1 && errno == EINTR);
+  /* EAGAIN is fine, the thread will wake up anyway */
+}
+
+/* Needs to be called with the lock held */
+
+static void processx__bgread_notify(processx__bgread_t *bg) {
+  ssize_t ret;
+  if (bg->notified) return;
+  do {
+    ret = write(bg->notify[1], "x", 1);
+  } while (ret == -1 && errno == EINTR);
+  bg->notified = 1;
+}
+
+/* Read everything we can from the fd. Needs to be called with the lock
+   held. */
+
+static void processx__bgread_fill(processx__bgread_t *bg) {
+  while (!bg->eof && !bg->error && bg->size < PROCESSX__BGREAD_MAX) {
+    ssize_t ret;
+    if (bg->start > 0 && bg->start + bg->size == bg->allocated) {
+      memmove(bg->data, bg->data + bg->start, bg->size);
+      bg->start = 0;
+    }
+    if (bg->start + bg->size == bg->allocated) {
+      size_t newsize = bg->allocated ? bg->allocated * 2 :
+	PROCESSX__BGREAD_CHUNK;
+      char *newdata = realloc(bg->data, newsize);
+      if (!newdata) {
+	bg->error = ENOMEM;
+	break;
+      }
+      bg->data = newdata;
+      bg->allocated = newsize;
+    }
+
+    ret = read(bg->fd, bg->data + bg->start + bg->size,
+	       bg->allocated - bg->start - bg->size);
+    if (ret > 0) {
+      bg->size += ret;
+    } else if (ret == 0) {
+      bg->eof = 1;
+    } else if (errno == EINTR) {
+      continue;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      break;
+    } else if (errno == EIO) {
+      /* PTY child side was closed, this is EOF */
+      bg->eof = 1;
+    } else {
+      bg->error = errno;
+    }
+  }
+
+  if (bg->size > 0 || bg->eof || bg->error) processx__bgread_notify(bg);
+}
+
+static void *processx__bgread_thread(void *arg) {
+  struct pollfd *fds = NULL;
+  processx__bgread_t **bgs = NULL;
+  size_t allocated = 0;
+
+  for (;;) {
+    processx__bgread_t *bg;
+    unsigned long generation;
+    size_t i, num = 1;
+    int ret;
+
+    pthread_mutex_lock(&processx__bgread_lock);
+    if (processx__bgread_stopping) {
+      pthread_mutex_unlock(&processx__bgread_lock);
+      break;
+    }
+
+    if (allocated < processx__bgread_count + 1) {
+      size_t newsize = processx__bgread_count + 1;
+      struct pollfd *newfds = realloc(fds, newsize * sizeof(struct pollfd));
+      processx__bgread_t **newbgs =
+	realloc(bgs, newsize * sizeof(processx__bgread_t*));
+      if (newfds) fds = newfds;
+      if (newbgs) bgs = newbgs;
+      if (newfds && newbgs) allocated = newsize;
+    }
+    if (allocated == 0) {
+      /* Out of memory, try again a bit later */
+      pthread_mutex_unlock(&processx__bgread_lock);
+      poll(NULL, 0, 100);
+      continue;
+    }
+
+    fds[0].fd = processx__bgread_control[0];
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+    for (bg = processx__bgread_list; bg && num < allocated; bg = bg->next) {
+      /* Stop reading if the buffer is full, the R thread will wake us
+	 up once it consumed some of it. */
+      if (bg->eof || bg->error || bg->size >= PROCESSX__BGREAD_MAX) continue;
+      fds[num].fd = bg->fd;
+      fds[num].events = POLLIN;
+      fds[num].revents = 0;
+      bgs[num] = bg;
+      num++;
+    }
+    generation = processx__bgread_generation;
+    pthread_mutex_unlock(&processx__bgread_lock);
+
+    ret = poll(fds, num, -1);
+    if (ret == -1) continue;
+
+    if (fds[0].revents) {
+      char buf[64];
+      while (read(processx__bgread_control[0], buf, sizeof(buf)) > 0) ;
+    }
+
+    pthread_mutex_lock(&processx__bgread_lock);
+    if (generation == processx__bgread_generation) {
+      for (i = 1; i < num; i++) {
+	if (fds[i].revents) processx__bgread_fill(bgs[i]);
+      }
+    }
+    pthread_mutex_unlock(&processx__bgread_lock);
+  }
+
+  free(fds);
+  free(bgs);
+  return NULL;
+}
+
+static int processx__bgread_pipe(int fds[2]) {
+  if (pipe(fds)) return -1;
+  processx__cloexec_fcntl(fds[0], 1);
+  processx__cloexec_fcntl(fds[1], 1);
+  processx__nonblock_fcntl(fds[0], 1);
+  processx__nonblock_fcntl(fds[1], 1);
+  return 0;
+}
+
+/* Needs to be called with the lock held. Returns 0 or an errno code. */
+
+static int processx__bgread_start_thread(void) {
+  pthread_attr_t attr;
+  sigset_t all, old;
+  int ret;
+
+  if (processx__bgread_running) return 0;
+
+  if (processx__bgread_control[0] < 0 &&
+      processx__bgread_pipe(processx__bgread_control)) {
+    return errno;
+  }
+
+  /* All signals are handled on the R thread. The new thread inherits
+     our mask, so it starts with everything blocked. */
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, 256 * 1024);
+  ret = pthread_create(&processx__bgread_thread_id, &attr,
+		       processx__bgread_thread, NULL);
+  pthread_attr_destroy(&attr);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (ret) return ret;
+
+  processx__bgread_running = 1;
+  return 0;
+}
+
+int processx__bgread_start(processx_connection_t *ccon) {
+  processx__bgread_t *bg;
+  int ret;
+
+  if (ccon->bgread) return 0;
+  if (ccon->handle < 0) return 0;
+
+  bg = calloc(1, sizeof(processx__bgread_t));
+  if (!bg) R_THROW_ERROR("Cannot start background reading, out of memory");
+  bg->fd = ccon->handle;
+  if (processx__bgread_pipe(bg->notify)) {
+    free(bg);
+    R_THROW_SYSTEM_ERROR("Cannot create pipe for background reading");
+  }
+
+  pthread_mutex_lock(&processx__bgread_lock);
+  ret = processx__bgread_start_thread();
+  if (ret) {
+    pthread_mutex_unlock(&processx__bgread_lock);
+    close(bg->notify[0]);
+    close(bg->notify[1]);
+    free(bg);
+    R_THROW_SYSTEM_ERROR_CODE(ret, "Cannot start background reader thread");
+  }
+  bg->next = processx__bgread_list;
+  processx__bgread_list = bg;
+  processx__bgread_count++;
+  processx__bgread_generation++;
+  ccon->bgread = bg;
+  pthread_mutex_unlock(&processx__bgread_lock);
+
+  processx__bgread_wakeup();
+  return 1;
+}
+
+void processx__bgread_stop(processx_connection_t *ccon) {
+  processx__bgread_t *bg = ccon->bgread, **prev;
+  if (!bg) return;
+
+  pthread_mutex_lock(&processx__bgread_lock);
+  for (prev = &processx__bgread_list; *prev; prev = &(*prev)->next) {
+    if (*prev == bg) {
+      *prev = bg->next;
+      processx__bgread_count--;
+      break;
+    }
+  }
+  processx__bgread_generation++;
+  pthread_mutex_unlock(&processx__bgread_lock);
+
+  /* The thread might still be in poll() with our fd, but it will throw
+     away the results, because the generation changed. */
+  processx__bgread_wakeup();
+
+  close(bg->notify[0]);
+  close(bg->notify[1]);
+  free(bg->data);
+  free(bg);
+  ccon->bgread = NULL;
+}
+
+/* Works like `read()` on a non-blocking fd: returns the number of bytes
+   copied, 0 on EOF, and -1 with `errno` set to EAGAIN if there is no data
+   yet, or to the error of the background read. */
+
+ssize_t processx__bgread_read(processx_connection_t *ccon, void *buf,
+			      size_t nbyte) {
+  processx__bgread_t *bg = ccon->bgread;
+  ssize_t ret;
+  int wakeup = 0;
+
+  pthread_mutex_lock(&processx__bgread_lock);
+  if (bg->size > 0) {
+    size_t n = bg->size < nbyte ? bg->size : nbyte;
+    memcpy(buf, bg->data + bg->start, n);
+    wakeup = bg->size >= PROCESSX__BGREAD_MAX;
+    bg->start += n;
+    bg->size -= n;
+    if (bg->size == 0) bg->start = 0;
+    ret = n;
+  } else if (bg->eof) {
+    ret = 0;
+  } else if (bg->error) {
+    errno = bg->error;
+    ret = -1;
+  } else {
+    errno = EAGAIN;
+    ret = -1;
+  }
+
+  if (bg->size == 0 && !bg->eof && !bg->error && bg->notified) {
+    char dummy;
+    while (read(bg->notify[0], &dummy, 1) == -1 && errno == EINTR) ;
+    bg->notified = 0;
+    if (ret == -1) errno = EAGAIN;
+  }
+  pthread_mutex_unlock(&processx__bgread_lock);
+
+  if (wakeup) processx__bgread_wakeup();
+  return ret;
+}
+
+/* The fd to poll, instead of the connection's fd */
+
+int processx__bgread_fd(processx_connection_t *ccon) {
+  processx__bgread_t *bg = ccon->bgread;
+  return bg->notify[0];
+}
+
+/* Called when the shared library is unloaded. The thread must not run
+   after the code is unmapped. */
+
+void processx__bgread_shutdown(void) {
+  pthread_mutex_lock(&processx__bgread_lock);
+  if (!processx__bgread_running) {
+    pthread_mutex_unlock(&processx__bgread_lock);
+    return;
+  }
+  processx__bgread_stopping = 1;
+  pthread_mutex_unlock(&processx__bgread_lock);
+
+  processx__bgread_wakeup();
+  pthread_join(processx__bgread_thread_id, NULL);
+
+  pthread_mutex_lock(&processx__bgread_lock);
+  processx__bgread_running = 0;
+  processx__bgread_stopping = 0;
+  pthread_mutex_unlock(&processx__bgread_lock);
+}
@@ -1,12 +1,195 @@
 
 #include "../processx.h"
 
-processx__child_list_t child_list_head = { 0, 0, 0 };
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+processx__child_list_t child_list_head = { 0, -1, 0, 0, -1 };
 processx__child_list_t *child_list = &child_list_head;
-processx__child_list_t child_free_list_head = { 0, 0, 0 };
+processx__child_list_t child_free_list_head = { 0, -1, 0, 0, -1 };
 processx__child_list_t *child_free_list = &child_free_list_head;
 
+/* On Linux 5.3 and above we open a pidfd for every child, and the
+   SIGCHLD handler polls all of them with a single poll() call, and
+   only calls waitpid() for the children that have exited. Without
+   pidfds it needs to call waitpid() for every child, on every SIGCHLD.
+
+   `child_pidfds` has room for at least `child_count` entries. It is only
+   resized in `processx__child_add()`, which runs with SIGCHLD blocked,
+   so the signal handler can use it without allocating memory. */
+
+int processx__use_pidfd = 1;
+static int child_count = 0;
+static struct pollfd *child_pidfds = NULL;
+static int child_pidfds_size = 0;
+
+/* The weak references to the status handles of the children are all in
+   one preserved list, instead of preserving each of them separately.
+   R_ReleaseObject() searches the precious list linearly, so with
+   thousands of children releasing them one by one is quadratic.
+   `child_weak_free` is a stack of the free slots of `child_weak_refs`. */
+
+static SEXP child_weak_refs = NULL;
+static int *child_weak_free = NULL;
+static int child_weak_num_free = 0;
+static int child_weak_size = 0;
+
+/* The children are also in a hash table, keyed by pid, for
+   `processx__child_find()`. The finalizer of every process handle looks
+   up its child, to decide who closes the pidfd (see processx__exit_fd()
+   in processx.c), so with a list walk, collecting many handles would be
+   quadratic. It uses open addressing with linear
+   probing, and it is at most half full. Children are removed from it in
+   the SIGCHLD handler, so removal does not allocate, and does not leave
+   tombstones behind. It is only resized in `processx__child_add()`, with
+   SIGCHLD blocked. */
+
+static processx__child_list_t **child_hash = NULL;
+static size_t child_hash_size = 0;	/* a power of two */
+
+static size_t processx__child_hash_pid(pid_t pid) {
+  return ((size_t) pid * 2654435761u) & (child_hash_size - 1);
+}
+
+static void processx__child_hash_insert(processx__child_list_t *child) {
+  size_t i = processx__child_hash_pid(child->pid);
+  while (child_hash[i]) i = (i + 1) & (child_hash_size - 1);
+  child_hash[i] = child;
+}
+
+static int processx__child_hash_reserve(size_t count) {
+  processx__child_list_t **old = child_hash;
+  size_t i, oldsize = child_hash_size;
+  size_t newsize = child_hash_size ? child_hash_size : 128;
+
+  while (count * 2 > newsize) newsize *= 2;
+  if (newsize == child_hash_size) return 0;
+
+  child_hash = calloc(newsize, sizeof(processx__child_list_t*));
+  if (!child_hash) {
+    child_hash = old;
+    return 1;
+  }
+  child_hash_size = newsize;
+  for (i = 0; i < oldsize; i++) {
+    if (old[i]) processx__child_hash_insert(old[i]);
+  }
+  free(old);
+  return 0;
+}
+
+/* Backward shift deletion: entries after the hole move into it, unless
+   their home slot is cyclically after the hole. */
+
+static void processx__child_hash_remove(processx__child_list_t *child) {
+  size_t mask = child_hash_size - 1, i, j;
+  if (!child_hash) return;
+
+  i = processx__child_hash_pid(child->pid);
+  while (child_hash[i] && child_hash[i] != child) i = (i + 1) & mask;
+  if (!child_hash[i]) return;
+
+  child_hash[i] = NULL;
+  for (j = (i + 1) & mask; child_hash[j]; j = (j + 1) & mask) {
+    size_t home = processx__child_hash_pid(child_hash[j]->pid);
+    if (((j - home) & mask) >= ((j - i) & mask)) {
+      child_hash[i] = child_hash[j];
+      child_hash[j] = NULL;
+      i = j;
+    }
+  }
+}
+
+/* A free slot in `child_weak_refs`, or -1 if out of memory */
+
+static int processx__child_weak_slot(void) {
+  if (child_weak_num_free == 0) {
+    int i, newsize = child_weak_size ? child_weak_size * 2 : 64;
+    SEXP newrefs = PROTECT(allocVector(VECSXP, newsize));
+    int *newfree = realloc(child_weak_free, newsize * sizeof(int));
+    if (!newfree) {
+      UNPROTECT(1);
+      return -1;
+    }
+    child_weak_free = newfree;
+    for (i = 0; i < child_weak_size; i++) {
+      SET_VECTOR_ELT(newrefs, i, VECTOR_ELT(child_weak_refs, i));
+    }
+    R_PreserveObject(newrefs);
+    if (child_weak_refs) R_ReleaseObject(child_weak_refs);
+    child_weak_refs = newrefs;
+    UNPROTECT(1);
+    for (i = newsize - 1; i >= child_weak_size; i--) {
+      child_weak_free[child_weak_num_free++] = i;
+    }
+    child_weak_size = newsize;
+  }
+
+  return child_weak_free[--child_weak_num_free];
+}
+
+int processx__pidfd_open(pid_t pid) {
+#if defined(__linux__) && defined(SYS_pidfd_open)
+  if (!processx__use_pidfd) return -1;
+  int fd = syscall(SYS_pidfd_open, pid, 0);
+  if (fd == -1 && errno == ENOSYS) processx__use_pidfd = 0;
+  return fd;
+#else
+  return -1;
+#endif
+}
+
+/* Poll the pidfds of all children, without blocking. This is called
+   from the SIGCHLD handler. Returns -1 if pidfds are not used, so
+   the caller needs to check every child with waitpid(). */
+
+int processx__child_poll_pidfds(void) {
+  processx__child_list_t *ptr = child_list->next;
+  int n = 0, ret;
+
+  if (child_pidfds_size == 0) return -1;
+
+  while (ptr) {
+    if (ptr->pidfd >= 0 && n < child_pidfds_size) {
+      child_pidfds[n].fd = ptr->pidfd;
+      child_pidfds[n].events = POLLIN;
+      child_pidfds[n].revents = 0;
+      n++;
+    }
+    ptr = ptr->next;
+  }
+
+  do {
+    ret = poll(child_pidfds, n, 0);
+  } while (ret == -1 && errno == EINTR);
+
+  /* On error we fall back to calling waitpid() for each child */
+  if (ret == -1) return -1;
+
+  return n;
+}
+
+/* Whether `ptr` might have exited, according to the last
+   `processx__child_poll_pidfds()` call. The pidfds are in the same
+   order as the list, so the caller walks both at the same time, `idx`
+   is the index of the next pidfd, start with zero. Children without a
+   pidfd always need to be checked. */
+
+int processx__child_pidfd_ready(processx__child_list_t *ptr, int *idx) {
+  if (ptr->pidfd < 0 || *idx >= child_pidfds_size) return 1;
+  if (child_pidfds[*idx].fd != ptr->pidfd) return 1;
+  return child_pidfds[(*idx)++].revents != 0;
+}
+
 void processx__freelist_add(processx__child_list_t *ptr) {
+  /* close() is async-signal-safe, so we can close the pidfd right away */
+  if (ptr->pidfd >= 0) {
+    close(ptr->pidfd);
+    ptr->pidfd = -1;
+  }
+  processx__child_hash_remove(ptr);
+  child_count--;
   ptr->next = child_free_list->next;
   child_free_list->next = ptr;
 }
@@ -18,7 +201,10 @@ void processx__freelist_free(void) {
   processx__child_list_t *ptr = child_free_list->next;
   while (ptr) {
     processx__child_list_t *next = ptr->next;
-    R_ReleaseObject(ptr->weak_status);
+    if (ptr->weak_slot >= 0) {
+      SET_VECTOR_ELT(child_weak_refs, ptr->weak_slot, R_NilValue);
+      child_weak_free[child_weak_num_free++] = ptr->weak_slot;
+    }
     free(ptr);
     ptr = next;
   }
@@ -32,15 +218,47 @@ void processx__child_finalizer(SEXP x) {
 int processx__child_add(pid_t pid, SEXP status) {
   processx__child_list_t *child = calloc(1, sizeof(processx__child_list_t));
   SEXP weak_ref;
+  int slot;
   if (!child) return 1;
 
+  if (processx__child_hash_reserve(child_count + 1)) {
+    free(child);
+    return 1;
+  }
+
+  if (child_count + 1 > child_pidfds_size && processx__use_pidfd) {
+    int newsize = child_pidfds_size ? child_pidfds_size * 2 : 64;
+    struct pollfd *newfds =
+      realloc(child_pidfds, newsize * sizeof(struct pollfd));
+    if (!newfds) {
+      free(child);
+      return 1;
+    }
+    child_pidfds = newfds;
+    child_pidfds_size = newsize;
+  }
+
+  slot = processx__child_weak_slot();
+  if (slot < 0) {
+    free(child);
+    return 1;
+  }
   weak_ref = R_MakeWeakRefC(status, R_NilValue, processx__child_finalizer, 1);
+  SET_VECTOR_ELT(child_weak_refs, slot, weak_ref);
 
   child->pid = pid;
-  R_PreserveObject(weak_ref);
+  child->pidfd = processx__pidfd_open(pid);
+  child_count++;
+  /* This is also the exit fd of the handle, see processx__exit_fd() */
+  if (child->pidfd >= 0) {
+    processx_handle_t *handle = R_ExternalPtrAddr(status);
+    if (handle) handle->waitpipe[0] = child->pidfd;
+  }
   child->weak_status = weak_ref;
+  child->weak_slot = slot;
   child->next = child_list->next;
   child_list->next = child;
+  processx__child_hash_insert(child);
   return 0;
 }
 
@@ -64,24 +282,28 @@ void processx__child_remove(pid_t pid) {
   }
 }
 
-/* This is actually not used currently. But it should work fine. */
+/* LCOV_EXCL_STOP */
+
+/* The child with `pid`, if it is still on the child list. This must be
+   called with SIGCHLD blocked. */
 
 processx__child_list_t *processx__child_find(pid_t pid) {
-  processx__child_list_t *ptr = child_list->next;
-  while (ptr) {
-    if (ptr->pid == pid) return ptr;
-    ptr = ptr->next;
+  size_t i;
+  if (!child_hash) return 0;
+  i = processx__child_hash_pid(pid);
+  while (child_hash[i]) {
+    if (child_hash[i]->pid == pid) return child_hash[i];
+    i = (i + 1) & (child_hash_size - 1);
   }
   return 0;
 }
 
-/* LCOV_EXCL_STOP */
-
 SEXP processx__unload_cleanup(void) {
   processx__child_list_t *ptr = child_list->next;
   int killed = 0;
 
   processx__remove_sigchld();
+  processx__bgread_shutdown();
 
   while (ptr) {
     processx__child_list_t *next = ptr->next;
@@ -104,13 +326,26 @@ SEXP processx__unload_cleanup(void) {
     /* The handle will be freed in the finalizer, otherwise there is
        a race condition here. */
 
+    if (ptr->pidfd >= 0) close(ptr->pidfd);
     free(ptr);
 
     ptr = next;
   }
 
   child_list->next = 0;
+  child_count = 0;
   processx__freelist_free();
+  free(child_pidfds);
+  child_pidfds = NULL;
+  child_pidfds_size = 0;
+  free(child_hash);
+  child_hash = NULL;
+  child_hash_size = 0;
+  if (child_weak_refs) R_ReleaseObject(child_weak_refs);
+  child_weak_refs = NULL;
+  free(child_weak_free);
+  child_weak_free = NULL;
+  child_weak_num_free = child_weak_size = 0;
 
   if (killed > 0) {
     REprintf("Unloading processx shared library, killed %d processes\n",
@@ -21,7 +21,8 @@ typedef struct processx_handle_s {
   int fd0;			/* writeable */
   int fd1;			/* readable */
   int fd2;			/* readable */
-  int waitpipe[2];		/* use it for wait() with timeout */
+  int waitpipe[2];		/* exit fd for wait() and poll(), a pidfd
+				   or a self-pipe, see processx__exit_fd() */
   int cleanup;
   double cleanup_grace;
   double create_time;
@@ -43,7 +44,8 @@ void processx__block_sigchld_save(sigset_t *old);
 void processx__unblock_sigchld(void);
 void processx__procmask_set(sigset_t *set);
 
-int c_processx_wait(processx_handle_t *handle, int timeout, const char *name);
+int c_processx_wait(SEXP status, int timeout, const char *name);
+int processx__wait_collect(SEXP status);
 int c_processx_kill(SEXP status, double grace, SEXP name);
 
 void processx__finalizer(SEXP status);
@@ -52,11 +54,19 @@ void processx__finalizer(SEXP status);
 
 typedef struct processx__child_list_s {
   pid_t pid;
+  int pidfd;			/* -1 if not available */
   SEXP weak_status;
   struct processx__child_list_s *next;
+  int weak_slot;		/* index of `weak_status`, see childlist.c */
 } processx__child_list_t;
 
+extern int processx__use_pidfd;
+
 int processx__child_add(pid_t pid, SEXP status);
+int processx__pidfd_open(pid_t pid);
+int processx__exit_fd(processx_handle_t *handle);
+int processx__child_poll_pidfds(void);
+int processx__child_pidfd_ready(processx__child_list_t *ptr, int *idx);
 void processx__child_remove(pid_t pid);
 processx__child_list_t *processx__child_find(pid_t pid);
 void processx__freelist_add(processx__child_list_t *ptr);
@@ -85,4 +95,11 @@ void processx__make_socketpair(int pipe[2], const char *name);
 
 double processx__create_time(long pid);
 
+int processx__bgread_start(processx_connection_t *ccon);
+void processx__bgread_stop(processx_connection_t *ccon);
+ssize_t processx__bgread_read(processx_connection_t *ccon, void *buf,
+			      size_t nbyte);
+int processx__bgread_fd(processx_connection_t *ccon);
+void processx__bgread_shutdown(void);
+
 #endif
@@ -15,12 +15,30 @@
 
 /* Internals */
 
-static void processx__child_init(processx_handle_t *handle, SEXP connections,
-				 int (*pipes)[2], int stdio_count,
-				 char *command, char **args,
-				 int error_fd, const char *pty_name, char **env,
-                                 processx_options_t *options,
-				 const char *tree_id);
+/* Everything the child process needs between fork() and exec().
+   The parent prepares all of this up front, so the child does not need
+   to allocate memory or look at R objects. This is required for the
+   CLONE_VM spawn, where the child shares the parent's address space,
+   until it calls exec(). */
+
+typedef struct {
+  int (*pipes)[2];		/* the child's private copy, it modifies it */
+  int stdio_count;
+  const char **stdio_files;	/* file name (or NULL) for each stdio fd */
+  char *command;
+  char **args;
+  char **shargs;		/* scratch space for the /bin/sh fallback */
+  char **env;			/* full environment, including the tree id */
+  int error_fd;
+  const char *pty_name;
+  int pty_main_fd;
+  processx_options_t *options;
+  sigset_t sigmask;		/* signal mask to restore in the child */
+  int reset_signals;		/* whether to reset signal handlers */
+} processx__child_args_t;
+
+static void processx__child_init(processx__child_args_t *ca);
+static pid_t processx__spawn_child(processx__child_args_t *ca);
 
 static SEXP processx__make_handle(SEXP private, int cleanup, double cleanup_grace);
 static void processx__handle_destroy(processx_handle_t *handle);
@@ -55,8 +73,28 @@ extern char **environ;
 
 #ifdef __linux__
 #include <sys/prctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#endif
+
+#include <limits.h>
+#ifndef PATH_MAX
+#define PATH_MAX 4096
 #endif
 
+/* On Linux we start children with clone(CLONE_VM | CLONE_VFORK), which
+   does not copy the page tables of the parent, so starting a process
+   does not get slower as the R process grows. Elsewhere, and if the
+   `PROCESSX_NO_VFORK` environment variable is set, we use fork(). */
+
+#if defined(__linux__) && !defined(__SANITIZE_ADDRESS__)
+#define PROCESSX__HAVE_CLONE_VFORK 1
+#define PROCESSX__CHILD_STACK_SIZE (64 * 1024)
+#endif
+
+static int processx__use_vfork = 1;
+
 extern processx__child_list_t child_list_head;
 extern processx__child_list_t *child_list;
 extern processx__child_list_t child_free_list_head;
@@ -72,18 +110,25 @@ void R_init_processx_unix(void) {
   processx__main_thread = pthread_self();
 
   child_list_head.pid = 0;
+  child_list_head.pidfd = -1;
   child_list_head.weak_status = R_NilValue;
   child_list_head.next = 0;
+  child_list_head.weak_slot = -1;
   child_list = &child_list_head;
 
   child_free_list_head.pid = 0;
+  child_free_list_head.pidfd = -1;
   child_free_list_head.weak_status = R_NilValue;
   child_free_list_head.next = 0;
+  child_free_list_head.weak_slot = -1;
   child_free_list = &child_free_list_head;
 
   if (getenv("PROCESSX_NOTIFY_OLD_SIGCHLD")) {
     processx__notify_old_sigchld_handler = 1;
   }
+
+  processx__use_vfork = getenv("PROCESSX_NO_VFORK") == NULL;
+  processx__use_pidfd = getenv("PROCESSX_NO_PIDFD") == NULL;
 }
 
 int processx__pty_main_open(char *sub_name, size_t sn_len) {
@@ -134,15 +179,195 @@ void processx__write_int(int fd, int err) {
   (void) dummy;
 }
 
-static void processx__child_init(processx_handle_t *handle, SEXP connections,
-                                 int (*pipes)[2], int stdio_count,
-                                 char *command, char **args,
-                                 int error_fd, const char *pty_name, char **env,
-                                 processx_options_t *options,
-                                 const char *tree_id) {
+/* Reset all signal handlers to the default, in the CLONE_VM child.
+   It has its own copy of the signal handlers, but an R signal handler
+   would run on the parent's memory, so we must not run any of them. */
+
+static void processx__child_reset_signals(void) {
+  struct sigaction sa;
+  int sig;
+  for (sig = 1; sig < NSIG; sig++) {
+    if (sigaction(sig, NULL, &sa) == -1) continue;
+    if (sa.sa_handler == SIG_IGN || sa.sa_handler == SIG_DFL) continue;
+    sa.sa_handler = SIG_DFL;
+    sa.sa_flags = 0;
+    sigemptyset(&sa.sa_mask);
+    sigaction(sig, &sa, NULL);
+  }
+}
+
+static void processx__child_exec_sh(const char *path, char **args,
+				    char **env, char **shargs) {
+  int i;
+  shargs[0] = "/bin/sh";
+  shargs[1] = (char*) path;
+  for (i = 1; args[i]; i++) shargs[i + 1] = args[i];
+  shargs[i + 1] = NULL;
+  execve("/bin/sh", shargs, env);
+}
+
+/* execvp() searches the PATH of the current environment, but we cannot
+   set `environ` in a CLONE_VM child, because it is shared with the
+   parent. So we search the PATH of `env` here, the same way as execvp()
+   does it, including the /bin/sh fallback for scripts without a #!
+   line. It only returns on error, with `errno` set. */
+
+static void processx__child_execvpe(const char *file, char **args,
+				    char **env, char **shargs) {
+  const char *path = NULL, *p, *z;
+  char buf[PATH_MAX];
+  size_t flen = strlen(file);
+  int i, got_eacces = 0;
+
+  if (flen == 0) {
+    errno = ENOENT;
+    return;
+  }
+
+  if (strchr(file, '/')) {
+    execve(file, args, env);
+    if (errno == ENOEXEC) processx__child_exec_sh(file, args, env, shargs);
+    return;
+  }
+
+  for (i = 0; env[i]; i++) {
+    if (!strncmp(env[i], "PATH=", 5)) {
+      path = env[i] + 5;
+      break;
+    }
+  }
+  if (!path) path = "/bin:/usr/bin";
+
+  for (p = path; ; p = z + 1) {
+    size_t dlen;
+    z = strchr(p, ':');
+    if (!z) z = p + strlen(p);
+    dlen = z - p;
+
+    if (dlen + flen + 2 <= sizeof(buf)) {
+      /* An empty PATH element is the current directory */
+      if (dlen > 0) {
+	memcpy(buf, p, dlen);
+	buf[dlen++] = '/';
+      }
+      memcpy(buf + dlen, file, flen + 1);
+
+      execve(buf, args, env);
+      switch (errno) {
+      case ENOEXEC:
+	processx__child_exec_sh(buf, args, env, shargs);
+	return;
+      case EACCES:
+	got_eacces = 1;
+	break;
+      case ENOENT:
+      case ENOTDIR:
+      case ESTALE:
+      case ENODEV:
+      case ETIMEDOUT:
+	break;
+      default:
+	return;
+      }
+    }
+
+    if (*z == '\0') break;
+  }
+
+  if (got_eacces) errno = EACCES;
+}
 
-  int close_fd, use_fd, fd, i;
+/* Make sure that the child does not inherit any other fds than its
+   standard streams and the extra connections, i.e. fds below
+   `stdio_count`. We set close-on-exec on all the others, that is a single
+   `close_range()` call on Linux 5.11 and above. This also keeps `error_fd`
+   open until exec(), it is close-on-exec already.
+
+   On older kernels we walk `/proc/self/fd`. We are in the child, possibly
+   sharing memory with the parent, so we cannot use `opendir()`, because
+   it allocates memory, we call `getdents64` directly. If neither works,
+   we close fds one by one, up to the fd limit. */
+
+#if defined(__linux__) && defined(SYS_getdents64)
+struct processx__dirent64 {
+  unsigned long long d_ino;
+  long long d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+#endif
+
+static void processx__child_close_fds(int stdio_count, int error_fd) {
+  int i, maxfd;
+
+#if defined(__linux__) && defined(SYS_close_range)
+#ifndef CLOSE_RANGE_CLOEXEC
+#define CLOSE_RANGE_CLOEXEC (1U << 2)
+#endif
+  if (syscall(SYS_close_range, (unsigned int) stdio_count, ~0U,
+              CLOSE_RANGE_CLOEXEC) == 0) {
+    return;
+  }
+#endif
+
+#if defined(__linux__) && defined(SYS_getdents64)
+  {
+    char buf[4096];
+    long n;
+    int dirfd = open("/proc/self/fd", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirfd >= 0) {
+      while ((n = syscall(SYS_getdents64, dirfd, buf, sizeof(buf))) > 0) {
+        long pos = 0;
+        while (pos < n) {
+          struct processx__dirent64 *d =
+            (struct processx__dirent64*) (buf + pos);
+          const char *c = d->d_name;
+          int fd = 0;
+          pos += d->d_reclen;
+          if (*c < '0' || *c > '9') continue;
+          for (; *c >= '0' && *c <= '9'; c++) fd = fd * 10 + (*c - '0');
+          if (fd >= stdio_count && fd != dirfd) {
+            processx__cloexec_fcntl(fd, 1);
+          }
+        }
+      }
+      close(dirfd);
+      if (n == 0) return;
+    }
+  }
+#endif
+
+  maxfd = (int) sysconf(_SC_OPEN_MAX);
+  if (maxfd < 0 || maxfd > 65536) maxfd = 65536;
+  for (i = stdio_count; i < maxfd; i++) {
+    if (i != error_fd) close(i);
+  }
+}
+
+/* On errors we use _exit() and not raise(SIGKILL), because raise() may
+   signal the calling thread by its cached id, and in the CLONE_VM child
+   that is the parent's thread. */
+
+static void processx__child_init(processx__child_args_t *ca) {
+
+  int (*pipes)[2] = ca->pipes;
+  int stdio_count = ca->stdio_count;
+  int error_fd = ca->error_fd;
+  const char *pty_name = ca->pty_name;
+  processx_options_t *options = ca->options;
+  int close_fd, use_fd, fd;
   int min_fd = 0;
+  sigset_t mask;
+
+  if (ca->reset_signals) processx__child_reset_signals();
+  /* With CLONE_VM `ca` is shared with the parent, which restores its
+     own mask from `ca->sigmask` after clone(), so we must not modify it */
+  mask = ca->sigmask;
+  sigdelset(&mask, SIGCHLD);
+  sigprocmask(SIG_SETMASK, &mask, NULL);
+
+  if (ca->pty_main_fd >= 0) close(ca->pty_main_fd);
 
   setsid();
 
@@ -150,7 +375,7 @@ static void processx__child_init(processx_handle_t *handle, SEXP connections,
   if (options->linux_pdeathsig > 0) {
     if (prctl(PR_SET_PDEATHSIG, options->linux_pdeathsig) == -1) {
       processx__write_int(error_fd, -errno);
-      raise(SIGKILL);
+      _exit(127);
     }
     /* Unblock the death signal in case the parent had it blocked at fork
        time (e.g. sanitizer runtimes temporarily block signals in fork
@@ -171,13 +396,13 @@ static void processx__child_init(processx_handle_t *handle, SEXP connections,
     int sub_fd = open(pty_name, O_RDWR);
     if (sub_fd == -1) {
       processx__write_int(error_fd, -errno);
-      raise(SIGKILL);
+      _exit(127);
     }
 
 #ifdef TIOCSCTTY
     if (ioctl(sub_fd, TIOCSCTTY, 0) == -1) {
       processx__write_int(error_fd, -errno);
-      raise(SIGKILL);
+      _exit(127);
     }
 #endif
 
@@ -187,7 +412,7 @@ static void processx__child_init(processx_handle_t *handle, SEXP connections,
     w.ws_col = options->pty_cols;
     if (ioctl(sub_fd, TIOCSWINSZ, &w) == -1) {
       processx__write_int(error_fd, -errno);
-      raise(SIGKILL);
+      _exit(127);
     }
 #endif
 
@@ -195,7 +420,7 @@ static void processx__child_init(processx_handle_t *handle, SEXP connections,
 
     if (tcgetattr(sub_fd, &tp) == -1) {
       processx__write_int(error_fd, -errno);
-      raise(SIGKILL);
+      _exit(127);
     }
 
     if (options->pty_echo) {
@@ -206,7 +431,7 @@ static void processx__child_init(processx_handle_t *handle, SEXP connections,
 
     if (tcsetattr(sub_fd, TCSAFLUSH, &tp) == -1) {
       processx__write_int(error_fd, -errno);
-      raise(SIGKILL);
+      _exit(127);
     }
 
     /* TODO: set other terminal attributes and size */
@@ -214,15 +439,15 @@ static void processx__child_init(processx_handle_t *handle, SEXP connections,
     /* Duplicate pty sub to be child's stdin, stdout, and stderr */
     if (dup2(sub_fd, STDIN_FILENO) != STDIN_FILENO) {
       processx__write_int(error_fd, -errno);
-      raise(SIGKILL);
+      _exit(127);
     }
     if (dup2(sub_fd, STDOUT_FILENO) != STDOUT_FILENO) {
       processx__write_int(error_fd, -errno);
-      raise(SIGKILL);
+      _exit(127);
     }
     if (dup2(sub_fd, STDERR_FILENO) != STDERR_FILENO) {
       processx__write_int(error_fd, -errno);
-      raise(SIGKILL);
+      _exit(127);
     }
 
     if (sub_fd > STDERR_FILENO) close(sub_fd);
@@ -242,7 +467,7 @@ static void processx__child_init(processx_handle_t *handle, SEXP connections,
     pipes[fd][1] = fcntl(use_fd, F_DUPFD, stdio_count);
     if (pipes[fd][1] == -1) {
       processx__write_int(error_fd, -errno);
-      raise(SIGKILL);
+      _exit(127);
     }
   }
 
@@ -250,9 +475,7 @@ static void processx__child_init(processx_handle_t *handle, SEXP connections,
      process properly. */
 
   for (fd = min_fd; fd < stdio_count; fd++) {
-    SEXP output = VECTOR_ELT(connections, fd);
-    const char *stroutput =
-      Rf_isString(output) ? CHAR(STRING_ELT(output, 0)) : NULL;
+    const char *stroutput = ca->stdio_files[fd];
 
     /* close_fd is an fd that must be closed. Initially this is the
        parent's end of a pipe. (-1 if no pipe for this fd.) */
@@ -292,7 +515,7 @@ static void processx__child_init(processx_handle_t *handle, SEXP connections,
 
       if (use_fd == -1) {
 	processx__write_int(error_fd, -errno);
-	raise(SIGKILL);
+	_exit(127);
       }
     }
 
@@ -308,7 +531,7 @@ static void processx__child_init(processx_handle_t *handle, SEXP connections,
 
     if (fd == -1) {
       processx__write_int(error_fd, -errno);
-      raise(SIGKILL);
+      _exit(127);
     }
 
     if (fd <= 2) processx__nonblock_fcntl(fd, 0);
@@ -323,31 +546,86 @@ static void processx__child_init(processx_handle_t *handle, SEXP connections,
     if (use_fd >= stdio_count) close(use_fd);
   }
 
-  for (i = stdio_count; i < error_fd; i++) {
-    close(i);
-  }
-  for (i = error_fd + 1; ; i++) {
-    if (-1 == close(i) && i > 200) break;
-  }
+  processx__child_close_fds(stdio_count, error_fd);
 
   if (options->wd != NULL && chdir(options->wd)) {
     processx__write_int(error_fd, - errno);
-    raise(SIGKILL);
+    _exit(127);
   }
 
-  if (env) environ = env;
+  processx__child_execvpe(ca->command, ca->args, ca->env, ca->shargs);
+  processx__write_int(error_fd, - errno);
+  _exit(127);
+}
 
-  if (putenv(strdup(tree_id))) {
-    processx__write_int(error_fd, - errno);
-    raise(SIGKILL);
+#ifdef PROCESSX__HAVE_CLONE_VFORK
+static int processx__child_clone_main(void *arg) {
+  processx__child_init((processx__child_args_t*) arg);
+  return 127;
+}
+#endif
+
+/* LCOV_EXCL_STOP */
+
+/* Start the child process. With CLONE_VFORK the parent is suspended
+   until the child calls exec() or exits, so `ca` stays valid in the
+   child. We block all signals around clone(), so no R signal handler
+   runs in the child before it resets them. If clone() fails, e.g.
+   because it is not allowed in a container, we fall back to fork(). */
+
+static pid_t processx__spawn_child(processx__child_args_t *ca) {
+  pid_t pid;
+
+#ifdef PROCESSX__HAVE_CLONE_VFORK
+  if (processx__use_vfork) {
+    sigset_t all;
+    char *stack = mmap(NULL, PROCESSX__CHILD_STACK_SIZE,
+		       PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (stack != MAP_FAILED) {
+      sigfillset(&all);
+      pthread_sigmask(SIG_SETMASK, &all, &ca->sigmask);
+      ca->reset_signals = 1;
+      pid = clone(processx__child_clone_main,
+		  stack + PROCESSX__CHILD_STACK_SIZE,
+		  CLONE_VM | CLONE_VFORK | SIGCHLD, ca);
+      pthread_sigmask(SIG_SETMASK, &ca->sigmask, NULL);
+      munmap(stack, PROCESSX__CHILD_STACK_SIZE);
+      if (pid != -1) return pid;
+    }
   }
+#endif
 
-  execvp(command, args);
-  processx__write_int(error_fd, - errno);
-  raise(SIGKILL);
+  pthread_sigmask(SIG_SETMASK, NULL, &ca->sigmask);
+  ca->reset_signals = 0;
+  pid = fork();
+  /* LCOV_EXCL_START */
+  if (pid == 0) processx__child_init(ca);
+  /* LCOV_EXCL_STOP */
+  return pid;
 }
 
-/* LCOV_EXCL_STOP */
+/* The environment of the child: `env`, or the current one if `env` is
+   NULL, plus the tree id, which replaces an existing entry for the same
+   variable. */
+
+static char **processx__make_child_env(char **env, const char *tree_id) {
+  char **src = env ? env : environ;
+  const char *eq = strchr(tree_id, '=');
+  size_t namelen = eq ? (size_t) (eq - tree_id + 1) : strlen(tree_id);
+  int i, n = 0, len = 0;
+  char **result;
+
+  while (src[len]) len++;
+  result = (char**) R_alloc(len + 2, sizeof(char*));
+  for (i = 0; i < len; i++) {
+    if (strncmp(src[i], tree_id, namelen)) result[n++] = src[i];
+  }
+  result[n++] = (char*) tree_id;
+  result[n] = NULL;
+
+  return result;
+}
 
 struct cleanup_kill_data {
   SEXP status;
@@ -411,8 +689,21 @@ static SEXP processx__make_handle(SEXP private, int cleanup, double cleanup_grac
 }
 
 static void processx__handle_destroy(processx_handle_t *handle) {
+  processx__child_list_t *child;
   if (!handle) return;
   if (handle->pty_child_fd >= 0) close(handle->pty_child_fd);
+
+  /* If the child is still in the child list, then the exit fd is its
+     pidfd, and the child list closes it, see processx__exit_fd() */
+  processx__block_sigchld();
+  child = processx__child_find(handle->pid);
+  if (handle->waitpipe[0] >= 0 &&
+      (!child || child->pidfd != handle->waitpipe[0])) {
+    close(handle->waitpipe[0]);
+  }
+  processx__unblock_sigchld();
+
+  if (handle->waitpipe[1] >= 0) close(handle->waitpipe[1]);
   free(handle);
 }
 
@@ -449,11 +740,55 @@ skip:
   processx__cloexec_fcntl(pipe[1], 1);
 }
 
-SEXP processx_exec(SEXP command, SEXP args, SEXP pty, SEXP pty_options,
-                   SEXP connections, SEXP env, SEXP windows_verbatim_args,
-                   SEXP windows_hide_window, SEXP windows_detached_process,
-                   SEXP private, SEXP cleanup, SEXP cleanup_grace, SEXP wd,
-                   SEXP encoding, SEXP tree_id, SEXP linux_pdeathsig) {
+/* A pipe for a "|" standard stream, with a capacity of `size` bytes.
+   Like for `processx__make_socketpair()`, `pipe[0]` is the parent's end
+   and `pipe[1]` is the child's. On Linux this is a real pipe, so its
+   direction depends on whether it is the standard input (`input`).
+   Setting the size is best effort, the system default is used if it
+   fails, e.g. because it is over the limit of unprivileged processes. */
+
+static void processx__make_sized_pipe(int pipe[2], int input, int size,
+				      const char *exe) {
+#if defined(__linux__) && defined(F_SETPIPE_SZ)
+  int fds[2];
+  if (pipe2(fds, O_CLOEXEC)) {
+    R_THROW_SYSTEM_ERROR("cannot make processx pipe while running '%s'",
+			 exe);
+  }
+  pipe[0] = input ? fds[1] : fds[0];
+  pipe[1] = input ? fds[0] : fds[1];
+  fcntl(fds[0], F_SETPIPE_SZ, size);
+#else
+  processx__make_socketpair(pipe, exe);
+  setsockopt(pipe[0], SOL_SOCKET, input ? SO_SNDBUF : SO_RCVBUF,
+	     &size, sizeof(size));
+  setsockopt(pipe[1], SOL_SOCKET, input ? SO_RCVBUF : SO_SNDBUF,
+	     &size, sizeof(size));
+#endif
+}
+
+/* Starting a process has two steps. `processx__exec_start()` creates the
+   pipes, starts the child, and registers it. `processx__exec_finish()`
+   waits until the child calls exec(), or fails to, via `signal_fd`, and
+   creates the connections. `processx_exec_many()` starts all children
+   first, and then waits for all of them with a single poll(). */
+
+typedef struct {
+  SEXP result;			/* the handle, protected by the caller */
+  SEXP private;
+  const char *command;
+  const char *encoding;
+  pid_t pid;
+  int signal_fd;		/* parent's end of the exec status pipe */
+} processx__exec_t;
+
+static SEXP processx__exec_start(processx__exec_t *ex,
+                                 SEXP command, SEXP args, SEXP pty,
+                                 SEXP pty_options, SEXP connections, SEXP env,
+                                 SEXP private, SEXP cleanup,
+                                 SEXP cleanup_grace, SEXP wd, SEXP encoding,
+                                 SEXP tree_id, SEXP linux_pdeathsig,
+                                 SEXP pipe_size) {
 
   char *ccommand = processx__tmp_string(command, 0);
   char **cargs = processx__tmp_character(args);
@@ -462,14 +797,13 @@ SEXP processx_exec(SEXP command, SEXP args, SEXP pty, SEXP pty_options,
   double ccleanup_grace = REAL(cleanup_grace)[0];
 
   const int cpty = LOGICAL(pty)[0];
-  const char *cencoding = CHAR(STRING_ELT(encoding, 0));
   const char *ctree_id = CHAR(STRING_ELT(tree_id, 0));
+  int cpipe_size = INTEGER(pipe_size)[0];
   processx_options_t options = { 0 };
   int num_connections = LENGTH(connections);
 
   pid_t pid;
-  int err, exec_errorno = 0, status;
-  ssize_t r;
+  int err;
   int signal_pipe[2] = { -1, -1 };
   int (*pipes)[2];
   int i;
@@ -479,10 +813,17 @@ SEXP processx_exec(SEXP command, SEXP args, SEXP pty, SEXP pty_options,
   char *pty_name = cpty ? pty_namex : 0;
 
   processx_handle_t *handle = NULL;
+  processx__child_args_t ca;
+  const char **stdio_files;
   SEXP result;
 
+  ex->private = private;
+  ex->command = ccommand;
+  ex->encoding = CHAR(STRING_ELT(encoding, 0));
+
   pipes = (int(*)[2]) R_alloc(num_connections, sizeof(int) * 2);
   for (i = 0; i < num_connections; i++) pipes[i][0] = pipes[i][1] = -1;
+  stdio_files = (const char**) R_alloc(num_connections, sizeof(char*));
 
   options.wd = isNull(wd) ? 0 : CHAR(STRING_ELT(wd, 0));
   options.linux_pdeathsig = INTEGER(linux_pdeathsig)[0];
@@ -514,13 +855,18 @@ SEXP processx_exec(SEXP command, SEXP args, SEXP pty, SEXP pty_options,
     SEXP output = VECTOR_ELT(connections, i);
     const char *stroutput =
       Rf_isString(output) ? CHAR(STRING_ELT(output, 0)) : NULL;
+    stdio_files[i] = stroutput;
 
     if (isNull(output)) {
       /* Ignored output, nothing to do, handled in the child */
 
     } else if (stroutput && ! strcmp("|", stroutput)) {
       /* pipe, need to create */
-      processx__make_socketpair(pipes[i], ccommand);
+      if (cpipe_size > 0 && i < 3) {
+        processx__make_sized_pipe(pipes[i], i == 0, cpipe_size, ccommand);
+      } else {
+        processx__make_socketpair(pipes[i], ccommand);
+      }
       if (i == 0) handle->fd0 = pipes[i][0];
       if (i == 1) handle->fd1 = pipes[i][0];
       if (i == 2) handle->fd2 = pipes[i][0];
@@ -545,9 +891,23 @@ SEXP processx_exec(SEXP command, SEXP args, SEXP pty, SEXP pty_options,
     }
   }
 
+  /* Everything for the child is allocated here, in the parent */
+  ca.pipes = (int(*)[2]) R_alloc(num_connections, sizeof(int) * 2);
+  memcpy(ca.pipes, pipes, num_connections * sizeof(int) * 2);
+  ca.stdio_count = num_connections;
+  ca.stdio_files = stdio_files;
+  ca.command = ccommand;
+  ca.args = cargs;
+  ca.shargs = (char**) R_alloc(LENGTH(args) + 2, sizeof(char*));
+  ca.env = processx__make_child_env(cenv, ctree_id);
+  ca.error_fd = signal_pipe[1];
+  ca.pty_name = pty_name;
+  ca.pty_main_fd = cpty ? pty_main_fd : -1;
+  ca.options = &options;
+
   processx__block_sigchld();
 
-  pid = fork();
+  pid = processx__spawn_child(&ca);
 
   /* TODO: how could we test a failure? */
   if (pid == -1) {		/* ERROR */
@@ -560,19 +920,6 @@ SEXP processx_exec(SEXP command, SEXP args, SEXP pty, SEXP pty_options,
                               ccommand);
   }
 
-  /* CHILD */
-  if (pid == 0) {
-    /* LCOV_EXCL_START */
-    if (cpty) close(pty_main_fd);
-    processx__unblock_sigchld();
-    processx__child_init(handle, connections, pipes, num_connections,
-			 ccommand, cargs, signal_pipe[1],
-                         pty_name, cenv, &options, ctree_id);
-    R_THROW_SYSTEM_ERROR("Cannot start child process when running '%s'",
-                         ccommand);
-    /* LCOV_EXCL_STOP */
-  }
-
   /* Query creation time ASAP. We'll use (pid, create_time) as an ID,
      to avoid race conditions when sending signals */
   handle->create_time = processx__create_time(pid);
@@ -606,52 +953,199 @@ SEXP processx_exec(SEXP command, SEXP args, SEXP pty, SEXP pty_options,
 
   if (signal_pipe[1] >= 0) close(signal_pipe[1]);
 
+  /* Closed unused ends of std pipes. If there is no parent end, then
+     this is an inherited std{in,out,err} fd, so we should not close it. */
+  for (i = 0; i < 3; i++) {
+    if (pipes[i][1] >= 0 && pipes[i][0] >= 0) close(pipes[i][1]);
+  }
+
+  ex->pid = pid;
+  ex->signal_fd = signal_pipe[0];
+  ex->result = result;
+
+  UNPROTECT(1);			/* result */
+  return result;
+}
+
+/* Returns 0 if the child started, or the errno of the failed exec() */
+
+static int processx__exec_finish(processx__exec_t *ex) {
+  processx_handle_t *handle = R_ExternalPtrAddr(ex->result);
+  int err, exec_errorno = 0, status;
+  ssize_t r;
+
   do {
-    r = read(signal_pipe[0], &exec_errorno, sizeof(exec_errorno));
+    r = read(ex->signal_fd, &exec_errorno, sizeof(exec_errorno));
   } while (r == -1 && errno == EINTR);
 
   if (r == 0) {
     ; /* okay, EOF */
   } else if (r == sizeof(exec_errorno)) {
     do {
-      err = waitpid(pid, &status, 0); /* okay, read errorno */
+      err = waitpid(ex->pid, &status, 0); /* okay, read errorno */
     } while (err == -1 && errno == EINTR);
 
   } else if (r == -1 && errno == EPIPE) {
     do {
-      err = waitpid(pid, &status, 0); /* okay, got EPIPE */
+      err = waitpid(ex->pid, &status, 0); /* okay, got EPIPE */
     } while (err == -1 && errno == EINTR);
 
   } else {
+    close(ex->signal_fd);
+    ex->signal_fd = -1;
     R_THROW_SYSTEM_ERROR_CODE(-exec_errorno,
                               "Child process '%s' failed to start",
-                              ccommand);
+                              ex->command);
   }
 
-  if (signal_pipe[0] >= 0) close(signal_pipe[0]);
-
-  /* Closed unused ends of std pipes. If there is no parent end, then
-     this is an inherited std{in,out,err} fd, so we should not close it. */
-  for (i = 0; i < 3; i++) {
-    if (pipes[i][1] >= 0 && pipes[i][0] >= 0) close(pipes[i][1]);
-  }
+  close(ex->signal_fd);
+  ex->signal_fd = -1;
 
   /* Create proper connections */
-  processx__create_connections(handle, private, cencoding);
+  processx__create_connections(handle, ex->private, ex->encoding);
 
+  if (exec_errorno == 0) handle->pid = ex->pid;
+  return exec_errorno;
+}
+
+SEXP processx_exec(SEXP command, SEXP args, SEXP pty, SEXP pty_options,
+                   SEXP connections, SEXP env, SEXP windows_verbatim_args,
+                   SEXP windows_hide_window, SEXP windows_detached_process,
+                   SEXP private, SEXP cleanup, SEXP cleanup_grace, SEXP wd,
+                   SEXP encoding, SEXP tree_id, SEXP linux_pdeathsig,
+                   SEXP pipe_size) {
+  processx__exec_t ex = { R_NilValue, R_NilValue, 0, 0, 0, -1 };
+  int exec_errorno;
+  SEXP result = PROTECT(processx__exec_start(
+    &ex, command, args, pty, pty_options, connections, env, private,
+    cleanup, cleanup_grace, wd, encoding, tree_id, linux_pdeathsig,
+    pipe_size));
+
+  exec_errorno = processx__exec_finish(&ex);
   if (exec_errorno == 0) {
-    handle->pid = pid;
     UNPROTECT(1);		/* result */
     return result;
   }
 
   // keep this in one line, othewise line numbers are off in sanitizer builds
   // because -O0 changes how instructions are mapped back to source lines
-  R_THROW_SYSTEM_ERROR_CODE(-exec_errorno, "cannot start processx process '%s'", ccommand);
+  R_THROW_SYSTEM_ERROR_CODE(-exec_errorno, "cannot start processx process '%s'", ex.command);
+
+  return R_NilValue;
+}
 
+static SEXP processx__exec_spec_start(processx__exec_t *ex, SEXP spec) {
+  return processx__exec_start(
+    ex,
+    VECTOR_ELT(spec, PROCESSX_EXEC_SPEC_COMMAND),
+    VECTOR_ELT(spec, PROCESSX_EXEC_SPEC_ARGS),
+    VECTOR_ELT(spec, PROCESSX_EXEC_SPEC_PTY),
+    VECTOR_ELT(spec, PROCESSX_EXEC_SPEC_PTY_OPTIONS),
+    VECTOR_ELT(spec, PROCESSX_EXEC_SPEC_CONNECTIONS),
+    VECTOR_ELT(spec, PROCESSX_EXEC_SPEC_ENV),
+    VECTOR_ELT(spec, PROCESSX_EXEC_SPEC_PRIVATE),
+    VECTOR_ELT(spec, PROCESSX_EXEC_SPEC_CLEANUP),
+    VECTOR_ELT(spec, PROCESSX_EXEC_SPEC_CLEANUP_GRACE),
+    VECTOR_ELT(spec, PROCESSX_EXEC_SPEC_WD),
+    VECTOR_ELT(spec, PROCESSX_EXEC_SPEC_ENCODING),
+    VECTOR_ELT(spec, PROCESSX_EXEC_SPEC_TREE_ID),
+    VECTOR_ELT(spec, PROCESSX_EXEC_SPEC_LINUX_PDEATHSIG),
+    VECTOR_ELT(spec, PROCESSX_EXEC_SPEC_PIPE_SIZE));
+}
+
+SEXP processx__exec_spec(SEXP spec, char *msg, size_t msg_size) {
+  processx__exec_t ex = { R_NilValue, R_NilValue, 0, 0, 0, -1 };
+  int exec_errorno;
+  SEXP result = PROTECT(processx__exec_spec_start(&ex, spec));
+
+  exec_errorno = processx__exec_finish(&ex);
+  UNPROTECT(1);			/* result */
+  if (exec_errorno == 0) return result;
+
+  snprintf(msg, msg_size,
+           "cannot start processx process '%s' (system error %d, %s)",
+           ex.command, exec_errorno, strerror(exec_errorno));
   return R_NilValue;
 }
 
+/* The state of `processx_exec_many()`. It is freed on exit, and then
+   we also close the exec status pipes of the children that were started,
+   if an error interrupted us. */
+
+typedef struct {
+  R_xlen_t num;
+  processx__exec_t exs[];
+} processx__exec_many_t;
+
+static void processx__exec_many_cleanup(void *data) {
+  processx__exec_many_t *many = data;
+  R_xlen_t i;
+  for (i = 0; i < many->num; i++) {
+    if (many->exs[i].signal_fd >= 0) close(many->exs[i].signal_fd);
+  }
+  free(many);
+}
+
+/* Start many processes at once. `specs` is a list, each element is a
+   list with the arguments of `processx_exec()`. We start all children
+   first, and then wait until all of them called exec(), with one poll()
+   call on their exec status pipes. Returns the list of handles.
+
+   With vfork() (the default on Linux) the parent is suspended until the
+   child called exec(), so the status pipes are final before the poll,
+   and the children do not overlap. They only overlap with fork(). */
+
+SEXP processx_exec_many(SEXP specs) {
+  R_xlen_t i, n = XLENGTH(specs), left = n;
+  R_xlen_t failed = -1;
+  int failed_errno = 0;
+  processx__exec_many_t *many;
+  struct pollfd *fds;
+  SEXP result = PROTECT(allocVector(VECSXP, n));
+
+  many = malloc(sizeof(processx__exec_many_t) + n * sizeof(processx__exec_t));
+  if (!many) R_THROW_ERROR("Cannot start processes, out of memory");
+  many->num = n;
+  for (i = 0; i < n; i++) many->exs[i].signal_fd = -1;
+  r_call_on_exit(processx__exec_many_cleanup, many);
+
+  fds = (struct pollfd*) R_alloc(n, sizeof(struct pollfd));
+
+  for (i = 0; i < n; i++) {
+    SEXP spec = VECTOR_ELT(specs, i);
+    SET_VECTOR_ELT(result, i, processx__exec_spec_start(many->exs + i, spec));
+  }
+
+  while (left > 0) {
+    int ret;
+    for (i = 0; i < n; i++) {
+      fds[i].fd = many->exs[i].signal_fd;
+      fds[i].events = POLLIN;
+      fds[i].revents = 0;
+    }
+    ret = poll(fds, n, -1);
+    if (ret == -1 && errno == EINTR) continue;
+    if (ret == -1) R_THROW_SYSTEM_ERROR("Cannot poll when starting processes");
+    for (i = 0; i < n; i++) {
+      int exec_errorno;
+      if (!fds[i].revents) continue;
+      exec_errorno = processx__exec_finish(many->exs + i);
+      if (exec_errorno != 0 && failed == -1) {
+        failed = i;
+        failed_errno = exec_errorno;
+      }
+      left--;
+    }
+  }
+
+  if (failed != -1) {
+    R_THROW_SYSTEM_ERROR_CODE(-failed_errno, "cannot start processx process '%s'", many->exs[failed].command);
+  }
+
+  UNPROTECT(1);
+  return result;
+}
+
 void processx__collect_exit_status(SEXP status, int retval, int wstat) {
   processx_handle_t *handle = R_ExternalPtrAddr(status);
 
@@ -695,12 +1189,35 @@ void processx__collect_exit_status(SEXP status, int retval, int wstat) {
   }
 }
 
-static void processx__wait_cleanup(void *ptr) {
-  int *fds = (int*) ptr;
-  if (!fds) return;
-  if (fds[0] >= 0) close(fds[0]);
-  if (fds[1] >= 0) close(fds[1]);
-  free(fds);
+/* The exit fd of a process is readable once the process has finished.
+ * It is kept until the handle is destroyed, so wait() and poll() can
+ * use the same fd.
+ *
+ * If we have pidfds, then this is the pidfd of the child list, that
+ * `processx__child_add()` stores in the handle. The child list owns it
+ * while the child is on the list. When the SIGCHLD handler removes the
+ * child, it leaves it open, and then the handle owns it. If the handle
+ * is destroyed first, the child list closes it.
+ *
+ * Otherwise it is a self-pipe, created on demand, whose write end is
+ * closed in the SIGCHLD handler, after collecting the exit status.
+ *
+ * This must be called with SIGCHLD blocked. Returns -1 on error.
+ */
+
+int processx__exit_fd(processx_handle_t *handle) {
+  if (handle->waitpipe[0] >= 0) return handle->waitpipe[0];
+
+  if (pipe(handle->waitpipe)) {
+    handle->waitpipe[0] = handle->waitpipe[1] = -1;
+    return -1;
+  }
+  processx__cloexec_fcntl(handle->waitpipe[0], 1);
+  processx__cloexec_fcntl(handle->waitpipe[1], 1);
+  processx__nonblock_fcntl(handle->waitpipe[0], 1);
+  processx__nonblock_fcntl(handle->waitpipe[1], 1);
+
+  return handle->waitpipe[0];
 }
 
 /* In general we need to worry about three asynchronous processes here:
@@ -720,8 +1237,9 @@ static void processx__wait_cleanup(void *ptr) {
  * 2. We block SIGCHLD.
  * 3. If we already collected the exit status, then this process has
  *    finished, so we don't need to wait.
- * 4. We set up a self-pipe that we can poll. The pipe will be closed in
- *    the SIGCHLD signal handler, and that triggers the poll event.
+ * 4. We get the exit fd of the process, see `processx__exit_fd()`.
+ *    This is a pidfd, or a self-pipe that will be closed in the SIGCHLD
+ *    signal handler, and that triggers the poll event.
  * 5. We unblock the SIGCHLD handler, so that it can trigger the pipe event.
  * 6. We start polling. We poll in small time chunks, to keep the wait still
  *    interruptible.
@@ -734,25 +1252,46 @@ SEXP processx_pty_close(SEXP status, SEXP name) {
 }
 
 SEXP processx_wait(SEXP status, SEXP timeout, SEXP name) {
-  processx_handle_t *handle = R_ExternalPtrAddr(status);
   int ctimeout = INTEGER(timeout)[0];
   const char *cname = isNull(name) ? "???" : CHAR(STRING_ELT(name, 0));
 
-  int ret = c_processx_wait(handle, ctimeout, cname);
+  int ret = c_processx_wait(status, ctimeout, cname);
   return ScalarLogical(ret);
 }
 
-int c_processx_wait(processx_handle_t *handle, int timeout, const char *name) {
+/* Collect the exit status of a process whose exit fd is readable. A
+ * pidfd is readable as soon as the process is a zombie, possibly before
+ * the SIGCHLD handler had a chance to run, e.g. because another package
+ * replaced it. The callers expect the exit status after a successful
+ * wait, so we collect it here.
+ *
+ * This must be called with SIGCHLD blocked. Returns 1 if the exit status
+ * is collected (it is NA if another handler collected it already), and
+ * 0 if the process is still running.
+ */
+
+int processx__wait_collect(SEXP status) {
+  processx_handle_t *handle = R_ExternalPtrAddr(status);
+  int wp, wstat;
+
+  if (!handle || handle->collected) return 1;
+
+  do {
+    wp = waitpid(handle->pid, &wstat, WNOHANG);
+  } while (wp == -1 && errno == EINTR);
+
+  if (wp == 0) return 0;
+  processx__collect_exit_status(status, wp, wstat);
+  return 1;
+}
+
+int c_processx_wait(SEXP status, int timeout, const char *name) {
+  processx_handle_t *handle = R_ExternalPtrAddr(status);
   struct pollfd fd;
   int ret = 0;
   pid_t pid;
   int timeleft = timeout;
 
-  int *fds = malloc(sizeof(int) * 2);
-  if (!fds) R_THROW_SYSTEM_ERROR("Allocating memory when waiting");
-  fds[0] = fds[1] = -1;
-  r_call_on_exit(processx__wait_cleanup, fds);
-
   sigset_t old;
   processx__block_sigchld_save(&old);
 
@@ -773,25 +1312,18 @@ int c_processx_wait(processx_handle_t *handle, int timeout, const char *name) {
   processx__setup_sigchld();
   processx__block_sigchld();
 
-  /* Setup the self-pipe that we can poll */
-  if (pipe(handle->waitpipe)) {
+  /* The exit fd that we can poll */
+  fd.fd = processx__exit_fd(handle);
+  if (fd.fd == -1) {
     processx__procmask_set(&old);
     R_THROW_SYSTEM_ERROR("processx error when waiting for '%s'", name);
   }
-  fds[0] = handle->waitpipe[0];
-  fds[1] = handle->waitpipe[1];
-  processx__nonblock_fcntl(handle->waitpipe[0], 1);
-  processx__nonblock_fcntl(handle->waitpipe[1], 1);
-
-  /* Poll on the pipe, need to unblock sigchld before */
-  fd.fd = handle->waitpipe[0];
   fd.events = POLLIN;
   fd.revents = 0;
 
+  /* Need to unblock sigchld before polling */
   processx__unblock_sigchld();
 
-
-
   while (timeout < 0 || timeleft > PROCESSX_INTERRUPT_INTERVAL) {
     do {
       ret = poll(&fd, 1, PROCESSX_INTERRUPT_INTERVAL);
@@ -823,20 +1355,172 @@ int c_processx_wait(processx_handle_t *handle, int timeout, const char *name) {
   }
 
   if (ret == -1) {
+    processx__procmask_set(&old);
     R_THROW_SYSTEM_ERROR("processx wait with timeout error while "
                          "waiting for '%s'", name);
   }
 
  cleanup:
-  /* pipe is closed in the on_exit handler */
-  handle->waitpipe[0] = -1;
-  handle->waitpipe[1] = -1;
-
+  if (ret != 0) {
+    processx__block_sigchld();
+    ret = processx__wait_collect(status);
+  }
   processx__procmask_set(&old);
 
   return ret != 0;
 }
 
+static double processx__wait_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+/* Wait for `count` of the processes in `statuses` to finish. This is
+ * like `processx_wait`, but it polls the exit fds of all processes in
+ * a single `poll()` call, and it returns as soon as enough of them have
+ * finished. It collects the exit statuses of the finished processes.
+ * Returns a logical vector, `TRUE` for the processes that have finished.
+ *
+ * Pidfds become readable when the process exits, even if another
+ * package replaced our SIGCHLD handler, so we only check the processes
+ * with a self-pipe with `kill()`, see `processx_wait` for why.
+ */
+
+SEXP processx_wait_many(SEXP statuses, SEXP timeout, SEXP count) {
+  R_xlen_t i, j, n = XLENGTH(statuses);
+  int ctimeout = INTEGER(timeout)[0];
+  int ccount = INTEGER(count)[0];
+  int ndone = 0, npending = 0, ret = 0;
+  double deadline = ctimeout < 0 ? 0 : processx__wait_now() + ctimeout;
+  struct pollfd *fds = (struct pollfd*) R_alloc(n + 1, sizeof(struct pollfd));
+  R_xlen_t *idx = (R_xlen_t*) R_alloc(n + 1, sizeof(R_xlen_t));
+  SEXP result = PROTECT(allocVector(LGLSXP, n));
+  int *cresult = LOGICAL(result);
+
+  sigset_t old;
+  processx__block_sigchld_save(&old);
+
+  /* Make sure this is active, in case another package replaced it... */
+  processx__setup_sigchld();
+  processx__block_sigchld();
+
+  for (i = 0; i < n; i++) {
+    processx_handle_t *handle = R_ExternalPtrAddr(VECTOR_ELT(statuses, i));
+    if (!handle || handle->collected) {
+      cresult[i] = 1;
+      ndone++;
+      continue;
+    }
+    cresult[i] = 0;
+    fds[npending].fd = processx__exit_fd(handle);
+    if (fds[npending].fd == -1) {
+      processx__procmask_set(&old);
+      R_THROW_SYSTEM_ERROR("processx error when waiting for process %d",
+                           (int) handle->pid);
+    }
+    fds[npending].events = POLLIN;
+    fds[npending].revents = 0;
+    idx[npending++] = i;
+  }
+
+  /* Need to unblock sigchld before polling */
+  processx__unblock_sigchld();
+
+  while (ndone < ccount && npending > 0) {
+    int ms = PROCESSX_INTERRUPT_INTERVAL, last = 0;
+    if (ctimeout >= 0) {
+      /* Poll once more after the deadline, without blocking */
+      double left = deadline - processx__wait_now();
+      if (left <= 0) {
+        ms = 0;
+        last = 1;
+      } else if (left < ms) {
+        ms = (int) left + 1;
+      }
+    }
+
+    do {
+      ret = poll(fds, npending, ms);
+    } while (ret == -1 && errno == EINTR);
+
+    if (ret == -1) {
+      processx__procmask_set(&old);
+      R_THROW_SYSTEM_ERROR("processx wait error while waiting for processes");
+    }
+
+    if (ret == 0) {
+      R_CheckUserInterrupt();
+      for (j = 0; j < npending; j++) {
+        processx_handle_t *handle =
+          R_ExternalPtrAddr(VECTOR_ELT(statuses, idx[j]));
+        if (!handle || handle->collected ||
+            (handle->waitpipe[1] >= 0 && kill(handle->pid, 0) != 0)) {
+          fds[j].revents = POLLIN;
+        }
+      }
+    }
+
+    /* Collect the finished processes, and drop them from the poll set */
+    processx__block_sigchld();
+    for (i = 0, j = 0; j < npending; j++) {
+      if (fds[j].revents &&
+          processx__wait_collect(VECTOR_ELT(statuses, idx[j]))) {
+        cresult[idx[j]] = 1;
+        ndone++;
+      } else {
+        fds[i] = fds[j];
+        fds[i].revents = 0;
+        idx[i++] = idx[j];
+      }
+    }
+    processx__unblock_sigchld();
+    npending = i;
+    if (last) break;
+  }
+
+  processx__procmask_set(&old);
+
+  UNPROTECT(1);
+  return result;
+}
+
+/* Pollable for the termination of the process. It polls the exit fd,
+   which stays readable after the process has finished. */
+
+static int processx__pre_poll_func_process(processx_pollable_t *pollable) {
+  processx_handle_t *handle = pollable->object;
+  int fd;
+
+  if (!handle) return PXCLOSED;
+
+  processx__block_sigchld();
+  if (handle->collected) {
+    processx__unblock_sigchld();
+    return PXREADY;
+  }
+  fd = processx__exit_fd(handle);
+  processx__unblock_sigchld();
+
+  if (fd == -1) {
+    R_THROW_SYSTEM_ERROR("Cannot poll for the exit of process %d",
+                         (int) handle->pid);
+  }
+
+  pollable->handle = fd;
+  return PXHANDLE;
+}
+
+int processx_c_pollable_from_process(processx_pollable_t *pollable,
+				     processx_handle_t *handle) {
+  pollable->pre_poll_func = processx__pre_poll_func_process;
+  pollable->object = handle;
+  pollable->free = 0;
+  pollable->write = 0;
+  pollable->fds = R_NilValue;
+  return 0;
+}
+
 /* This is similar to `processx_wait`, but a bit simpler, because we
  * don't need to wait and poll. The same restrictions listed there, also
  * apply here.
@@ -1091,7 +1775,7 @@ int c_processx_kill(SEXP status, double grace, SEXP name) {
 
   if (grace_ms) {
     KILL_WITH(SIGTERM);
-    if (c_processx_wait(handle, grace_ms, cname)) {
+    if (c_processx_wait(status, grace_ms, cname)) {
       result = handle->exitcode == -SIGTERM;
       goto cleanup;
     }
@@ -34,15 +34,25 @@ void processx__sigchld_callback(int sig, siginfo_t *info, void *ctx) {
      (on some platforms at least) a single signal might be delivered
      for multiple children exiting around the same time. For example this
      happens if multiple SIGCHLD signals arrive while SIGCHLD is blocked.
-     So we need to iterate over all children to see which one has exited. */
+     So we need to iterate over all children to see which one has exited.
+     If we have pidfds, then a single poll() tells us which children have
+     exited, and we only call waitpid() for those. */
 
   processx__child_list_t *ptr = child_list->next;
   processx__child_list_t *prev = child_list;
+  int npidfds = processx__child_poll_pidfds();
+  int pidfd_idx = 0;
 
   while (ptr) {
     processx__child_list_t *next = ptr->next;
     int wp, wstat;
 
+    if (npidfds >= 0 && !processx__child_pidfd_ready(ptr, &pidfd_idx)) {
+      prev = ptr;
+      ptr = next;
+      continue;
+    }
+
     /* Check if this child has exited */
     do {
       wp = waitpid(ptr->pid, &wstat, WNOHANG);
@@ -74,6 +84,11 @@ void processx__sigchld_callback(int sig, siginfo_t *info, void *ctx) {
       /* If waitpid errored with ECHILD, then the exit status is set to NA */
       if (handle) processx__collect_exit_status(status, wp, wstat);
 
+      /* The handle owns the pidfd from now on, see processx__exit_fd() */
+      if (handle && ptr->pidfd >= 0 && handle->waitpipe[0] == ptr->pidfd) {
+	ptr->pidfd = -1;
+      }
+
       /* Defer freeing the memory, because malloc/free are typically not
 	 reentrant, and if we free in the SIGCHLD handler, that can cause
 	 crashes. The test case in test-run.R (see comments there)
@@ -894,6 +894,13 @@ static WCHAR* processx__search_path(const WCHAR *file,
 
 void processx__collect_exit_status(SEXP status, DWORD exitcode);
 
+static void processx__unregister_wait(processx_handle_t *handle) {
+  if (handle->waitObject) {
+    UnregisterWaitEx(handle->waitObject, INVALID_HANDLE_VALUE);
+    handle->waitObject = NULL;
+  }
+}
+
 DWORD processx__terminate(processx_handle_t *handle, SEXP status) {
   DWORD err;
 
@@ -901,6 +908,7 @@ DWORD processx__terminate(processx_handle_t *handle, SEXP status) {
   if (err) processx__collect_exit_status(status, 2);
 
   WaitForSingleObject(handle->hProcess, INFINITE);
+  processx__unregister_wait(handle);
   CloseHandle(handle->hProcess);
   handle->hProcess = 0;
   return err;
@@ -916,6 +924,7 @@ void processx__finalizer(SEXP status) {
     processx__terminate(handle, status);
   }
 
+  processx__unregister_wait(handle);
   if (handle->hProcess) CloseHandle(handle->hProcess);
   handle->hProcess = NULL;
   R_ClearExternalPtr(status);
@@ -953,7 +962,8 @@ SEXP processx_exec(SEXP command, SEXP args, SEXP pty, SEXP pty_options,
 		               SEXP connections, SEXP env, SEXP windows_verbatim_args,
                    SEXP windows_hide, SEXP windows_detached_process,
                    SEXP private, SEXP cleanup, SEXP cleanup_grace, SEXP wd,
-                   SEXP encoding, SEXP tree_id, SEXP linux_pdeathsig) {
+                   SEXP encoding, SEXP tree_id, SEXP linux_pdeathsig,
+                   SEXP pipe_size) {
 
   const char *ccommand = CHAR(STRING_ELT(command, 0));
   const char *cencoding = CHAR(STRING_ELT(encoding, 0));
@@ -1416,6 +1426,49 @@ SEXP processx_exec(SEXP command, SEXP args, SEXP pty, SEXP pty_options,
   return result;
 }
 
+static SEXP processx__exec_spec_body(void *data) {
+  SEXP spec = (SEXP) data;
+  return processx_exec(
+    VECTOR_ELT(spec, PROCESSX_EXEC_SPEC_COMMAND),
+    VECTOR_ELT(spec, PROCESSX_EXEC_SPEC_ARGS),
+    VECTOR_ELT(spec, PROCESSX_EXEC_SPEC_PTY),
+    VECTOR_ELT(spec, PROCESSX_EXEC_SPEC_PTY_OPTIONS),
+    VECTOR_ELT(spec, PROCESSX_EXEC_SPEC_CONNECTIONS),
+    VECTOR_ELT(spec, PROCESSX_EXEC_SPEC_ENV),
+    VECTOR_ELT(spec, PROCESSX_EXEC_SPEC_VERBATIM_ARGS),
+    VECTOR_ELT(spec, PROCESSX_EXEC_SPEC_HIDE_WINDOW),
+    VECTOR_ELT(spec, PROCESSX_EXEC_SPEC_DETACHED_PROCESS),
+    VECTOR_ELT(spec, PROCESSX_EXEC_SPEC_PRIVATE),
+    VECTOR_ELT(spec, PROCESSX_EXEC_SPEC_CLEANUP),
+    VECTOR_ELT(spec, PROCESSX_EXEC_SPEC_CLEANUP_GRACE),
+    VECTOR_ELT(spec, PROCESSX_EXEC_SPEC_WD),
+    VECTOR_ELT(spec, PROCESSX_EXEC_SPEC_ENCODING),
+    VECTOR_ELT(spec, PROCESSX_EXEC_SPEC_TREE_ID),
+    VECTOR_ELT(spec, PROCESSX_EXEC_SPEC_LINUX_PDEATHSIG),
+    VECTOR_ELT(spec, PROCESSX_EXEC_SPEC_PIPE_SIZE));
+}
+
+/* processx_exec() throws an error if it cannot start the process, the
+   caller needs to catch it. */
+
+SEXP processx__exec_spec(SEXP spec, char *msg, size_t msg_size) {
+  return processx__exec_spec_body(spec);
+}
+
+/* CreateProcess() returns after the process was created, so there is
+   no exec status to wait for, we just start the processes one by one. */
+
+SEXP processx_exec_many(SEXP specs) {
+  R_xlen_t i, n = XLENGTH(specs);
+  SEXP result = PROTECT(allocVector(VECSXP, n));
+  for (i = 0; i < n; i++) {
+    SET_VECTOR_ELT(result, i,
+                   processx__exec_spec_body(VECTOR_ELT(specs, i)));
+  }
+  UNPROTECT(1);
+  return result;
+}
+
 void processx__collect_exit_status(SEXP status, DWORD exitcode) {
   processx_handle_t *handle = R_ExternalPtrAddr(status);
   handle->exitcode = exitcode;
@@ -1491,6 +1544,124 @@ SEXP processx_wait(SEXP status, SEXP timeout, SEXP name) {
   return ScalarLogical(TRUE);
 }
 
+/* Wait for `count` of the processes in `statuses` to finish, like
+   `processx_wait`, but with a single WaitForMultipleObjects() call. It
+   can only wait on MAXIMUM_WAIT_OBJECTS handles, so if there are more
+   processes, then it waits on the first ones, and checks the rest after
+   every PROCESSX_INTERRUPT_INTERVAL. Returns a logical vector, `TRUE`
+   for the processes that have finished. */
+
+SEXP processx_wait_many(SEXP statuses, SEXP timeout, SEXP count) {
+  R_xlen_t i, j, n = XLENGTH(statuses);
+  int ctimeout = INTEGER(timeout)[0];
+  int ccount = INTEGER(count)[0];
+  int ndone = 0, npending = 0;
+  ULONGLONG deadline = GetTickCount64() + (ctimeout < 0 ? 0 : ctimeout);
+  HANDLE handles[MAXIMUM_WAIT_OBJECTS];
+  R_xlen_t *idx = (R_xlen_t*) R_alloc(n + 1, sizeof(R_xlen_t));
+  SEXP result = PROTECT(allocVector(LGLSXP, n));
+  int *cresult = LOGICAL(result);
+
+  for (i = 0; i < n; i++) {
+    processx_handle_t *handle = R_ExternalPtrAddr(VECTOR_ELT(statuses, i));
+    cresult[i] = !handle || handle->collected;
+    if (cresult[i]) {
+      ndone++;
+    } else {
+      idx[npending++] = i;
+    }
+  }
+
+  while (ndone < ccount && npending > 0) {
+    DWORD ms = PROCESSX_INTERRUPT_INTERVAL, nwait, err;
+    int last = 0;
+    if (ctimeout >= 0) {
+      /* Check once more after the deadline, without blocking */
+      ULONGLONG now = GetTickCount64();
+      if (now >= deadline) {
+        ms = 0;
+        last = 1;
+      } else if (deadline - now < ms) {
+        ms = (DWORD) (deadline - now);
+      }
+    }
+
+    nwait = npending < MAXIMUM_WAIT_OBJECTS ? npending : MAXIMUM_WAIT_OBJECTS;
+    for (j = 0; j < nwait; j++) {
+      processx_handle_t *handle =
+        R_ExternalPtrAddr(VECTOR_ELT(statuses, idx[j]));
+      handles[j] = handle->hProcess;
+    }
+    err = WaitForMultipleObjects(nwait, handles, FALSE, ms);
+    if (err == WAIT_FAILED) {
+      R_THROW_SYSTEM_ERROR("failed to wait on processes");
+    }
+    if (err == WAIT_TIMEOUT) R_CheckUserInterrupt();
+
+    /* Collect all finished processes, not just the one that woke us up */
+    for (i = 0, j = 0; j < npending; j++) {
+      SEXP status = VECTOR_ELT(statuses, idx[j]);
+      processx_handle_t *handle = R_ExternalPtrAddr(status);
+      DWORD exitcode;
+      if (WaitForSingleObject(handle->hProcess, 0) == WAIT_OBJECT_0) {
+        if (!GetExitCodeProcess(handle->hProcess, &exitcode)) {
+          R_THROW_SYSTEM_ERROR("cannot get exit code after wait");
+        }
+        processx__collect_exit_status(status, exitcode);
+        cresult[idx[j]] = 1;
+        ndone++;
+      } else {
+        idx[i++] = idx[j];
+      }
+    }
+    npending = i;
+    if (last) break;
+  }
+
+  UNPROTECT(1);
+  return result;
+}
+
+/* Pollable for the termination of the process. The poll loop waits on
+   the IOCP, so we register a wait on the process handle, that wakes it
+   up when the process exits. The poll loop then checks the handle. */
+
+static VOID CALLBACK processx__exit_callback(PVOID data, BOOLEAN timeout) {
+  HANDLE iocp = processx__get_default_iocp();
+  if (iocp) PostQueuedCompletionStatus(iocp, 0, processx__key_none, 0);
+}
+
+static int processx__pre_poll_func_process(processx_pollable_t *pollable) {
+  processx_handle_t *handle = pollable->object;
+
+  if (!handle) return PXCLOSED;
+  if (handle->collected || !handle->hProcess) return PXREADY;
+  if (WaitForSingleObject(handle->hProcess, 0) == WAIT_OBJECT_0) {
+    return PXREADY;
+  }
+
+  /* If this fails, the poll loop still checks the process
+     in every PROCESSX_INTERRUPT_INTERVAL */
+  if (!handle->waitObject) {
+    RegisterWaitForSingleObject(&handle->waitObject, handle->hProcess,
+				processx__exit_callback, NULL, INFINITE,
+				WT_EXECUTEONLYONCE);
+  }
+
+  pollable->handle = handle->hProcess;
+  return PXWAIT;
+}
+
+int processx_c_pollable_from_process(processx_pollable_t *pollable,
+				     processx_handle_t *handle) {
+  pollable->pre_poll_func = processx__pre_poll_func_process;
+  pollable->object = handle;
+  pollable->free = 0;
+  pollable->write = 0;
+  pollable->fds = R_NilValue;
+  return 0;
+}
+
 SEXP processx_is_alive(SEXP status, SEXP name) {
   processx_handle_t *handle = R_ExternalPtrAddr(status);
   const char *cname = isNull(name) ? "???" : CHAR(STRING_ELT(name, 0));